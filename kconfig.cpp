@@ -21,7 +21,30 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <iostream>
 #include <KConfig>
 #include <KConfigGroup>
+#include <KGlobal>
+#include <KLocale>
+#include <KLockFile>
+#include <KSaveFile>
+#include <KStandardDirs>
+#include <QAtomicInt>
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDir>
 #include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QMutex>
+#include <QPair>
+#include <QRunnable>
+#include <QSet>
+#include <QSocketNotifier>
+#include <QTextCodec>
+#include <QTextStream>
+#include <QThreadPool>
+#include <QThreadStorage>
+#include <QVector>
 #include <QtDebug>
 // #include <QSettings>
 
@@ -30,11 +53,324 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
     #define IS_A_TTY(_I_) _isatty(_I_)
 #else
     #include <unistd.h>
+    #include <fcntl.h>
+    #include <sys/file.h>
+    #include <sys/socket.h>
     #define IS_A_TTY(_I_) isatty(_I_)
+    #ifndef MSG_NOSIGNAL
+        #define MSG_NOSIGNAL 0
+    #endif
 #endif
+#include <sys/stat.h>
+#ifdef Q_OS_LINUX
+    #include <sys/inotify.h>
+    #include <poll.h>
+#endif
+#include <cstdio>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <cstdlib>
 
 #define CHAR(_S_) _S_.toLocal8Bit().data()
 static const char *gs_separator = "\n  ---";
+static bool gs_batch = false;
+static bool gs_multiFile = false;
+static bool gs_mapped = false; // --fast
+static bool gs_useIndex = true;
+// which files of the cascade are read, --layer and --no-globals
+enum Layer { AllLayers = 0, UserLayer, SystemLayer };
+static Layer gs_layer = AllLayers;
+static bool gs_noGlobals = false;
+static bool gs_showLayer = false;
+static bool gs_tty = IS_A_TTY(1);
+static bool gs_printPath = false; // read says where the value comes from, like on a tty, for multi file queries
+
+/**
+ * What --stats reports, the times are in microseconds. Workers of multi file queries count as well,
+ * so the counters are atomic and the totals, which would overflow an int, are added under the mutex.
+ * Nothing is measured unless gs_stats is set.
+ */
+struct Stats
+{
+    Stats() : parse(0), sync(0), output(0), outputBytes(0), start(0), startup(0), json(false) {}
+    void add(qint64 Stats::*total, qint64 value) { QMutexLocker locker(&mutex); this->*total += value; }
+    qint64 parse, sync, output; // the other phases are derived from the total in printStats()
+    qint64 outputBytes;
+    QMutex mutex;
+    QAtomicInt files, groups, matches, regExps, syncs;
+    qint64 start, startup;
+    bool json;
+};
+static Stats *gs_stats = 0;
+#define COUNT(_C_) if (gs_stats) gs_stats->_C_.ref()
+
+static qint64 now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// adds the time of its scope to a phase
+class StatsTimer
+{
+public:
+    StatsTimer(qint64 Stats::*phase) : m_phase(phase), m_start(gs_stats ? now() : 0) {}
+    ~StatsTimer() { if (gs_stats) gs_stats->add(m_phase, now() - m_start); }
+private:
+    qint64 Stats::*m_phase;
+    qint64 m_start;
+};
+
+/**
+ * All output is collected in one buffer that is written in large chunks.
+ * Text is the human readable format, the others print every result as a record with the fields
+ * type, path, key, value, oldkey and oldvalue - as JSON lines (leaving out fields that don't apply),
+ * tab separated (backslash, tab, CR and LF escaped) or with every field NUL terminated.
+ */
+class Output
+{
+public:
+    enum Format { Text = 0, Json, Tsv, Nul };
+    Output(Format format = Text, std::ostream *sink = 0);
+    ~Output() { flush(); }
+    void setFormat(Format format) { m_format = format; }
+    Format format() const { return m_format; }
+    bool isText() const { return m_format == Text; }
+    // human readable text, the other formats skip it
+    Output &operator<<(const QString &text) { if (isText()) append(text, Text); return *this; }
+    Output &operator<<(const char *text) { if (isText()) m_buffer += text; return *this; }
+    // results
+    // layer is the file the value comes from, for --show-layer
+    void entry(const QString &path, const QString &key, const QString &value, const QString &layer = QString());
+    void name(const char *type, const QString &path, const QString &name);
+    void added(const QString &path, const QString &key, const QString &value);
+    // newKey is only printed if not null
+    void changed(const QString &path, const QString &key, const QString &oldValue, const QString &newKey, const QString &value);
+    void removed(const QString &path, const QString &key, const QString &value);
+    void error(const QString &path, const QString &message);
+    // a result the text format has no line for
+    void record(const char *type, const QString &path, const QString &key = QString(), const QString &value = QString(),
+                const QString &oldKey = QString(), const QString &oldValue = QString());
+    // output that is formatted already, like that of other buffers
+    void write(const char *data, size_t size) { m_buffer.append(data, size); flushIfFull(); }
+    void flush();
+    std::string take() { std::string ret; ret.swap(m_buffer); return ret; }
+private:
+    void append(const QString &string, Format escape);
+    void append(char c, Format escape);
+    void flushIfFull() { if (m_buffer.size() > size_t(BufferSize)) flush(); }
+    Format m_format;
+    std::ostream *m_sink;
+    std::string m_buffer;
+    int m_utf8; // -1 until the locale codec was checked
+    enum { BufferSize = 1 << 16 };
+};
+
+Output::Output(Format format, std::ostream *sink) : m_format(format), m_sink(sink), m_utf8(-1)
+{
+    m_buffer.reserve(BufferSize);
+}
+
+void Output::flush()
+{
+    if (!m_sink || m_buffer.empty())
+        return;
+    StatsTimer timer(&Stats::output);
+    if (gs_stats)
+        gs_stats->add(&Stats::outputBytes, m_buffer.size());
+    m_sink->write(m_buffer.data(), m_buffer.size());
+    m_sink->flush();
+    m_buffer.clear(); // keeps the capacity
+}
+
+void Output::append(char c, Format escape)
+{
+    switch (escape) {
+    case Json:
+        if (c == '"' || c == '\\') {
+            m_buffer += '\\';
+            m_buffer += c;
+        } else if (c == '\n') {
+            m_buffer += "\\n";
+        } else if (c == '\t') {
+            m_buffer += "\\t";
+        } else if (c == '\r') {
+            m_buffer += "\\r";
+        } else if (uchar(c) < 0x20) {
+            char code[7];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            m_buffer += code;
+        } else {
+            m_buffer += c;
+        }
+        break;
+    case Tsv:
+        if (c == '\\')
+            m_buffer += "\\\\";
+        else if (c == '\t')
+            m_buffer += "\\t";
+        else if (c == '\n')
+            m_buffer += "\\n";
+        else if (c == '\r')
+            m_buffer += "\\r";
+        else
+            m_buffer += c;
+        break;
+    case Nul:
+        if (c)
+            m_buffer += c;
+        break;
+    default:
+        m_buffer += c;
+    }
+}
+
+// encodes UTF-8 right into the buffer instead of going through a temporary QByteArray
+void Output::append(const QString &string, Format escape)
+{
+    if (m_utf8 < 0)
+        m_utf8 = QTextCodec::codecForLocale()->mibEnum() == 106;
+    if (!m_utf8 && escape != Json) { // JSON is always UTF-8
+        const QByteArray local = string.toLocal8Bit();
+        for (const char *c = local.constData(), *end = c + local.size(); c < end; ++c)
+            append(*c, escape);
+        return;
+    }
+    for (const ushort *c = string.utf16(), *end = c + string.length(); c < end; ++c) {
+        uint u = *c;
+        if (u < 0x80) {
+            append(char(u), escape);
+            continue;
+        }
+        if (u < 0x800) {
+            m_buffer += char(0xc0 | (u >> 6));
+        } else {
+            if ((u & 0xfc00) == 0xd800 && c + 1 < end && (c[1] & 0xfc00) == 0xdc00) {
+                u = 0x10000 + ((u - 0xd800) << 10) + (*++c - 0xdc00);
+                m_buffer += char(0xf0 | (u >> 18));
+                m_buffer += char(0x80 | ((u >> 12) & 0x3f));
+            } else {
+                m_buffer += char(0xe0 | (u >> 12));
+            }
+            m_buffer += char(0x80 | ((u >> 6) & 0x3f));
+        }
+        m_buffer += char(0x80 | (u & 0x3f));
+    }
+}
+
+void Output::record(const char *type, const QString &path, const QString &key, const QString &value,
+                    const QString &oldKey, const QString &oldValue)
+{
+    if (isText())
+        return;
+    const QString *fields[5] = { &path, &key, &value, &oldKey, &oldValue };
+    static const char *names[5] = { "path", "key", "value", "oldkey", "oldvalue" };
+    if (m_format == Json) {
+        m_buffer += "{\"type\":\"";
+        m_buffer += type;
+        m_buffer += '"';
+        for (int i = 0; i < 5; ++i) {
+            if (fields[i]->isNull())
+                continue;
+            m_buffer += ",\"";
+            m_buffer += names[i];
+            m_buffer += "\":\"";
+            append(*fields[i], Json);
+            m_buffer += '"';
+        }
+        m_buffer += "}\n";
+    } else {
+        const char separator = m_format == Tsv ? '\t' : '\0';
+        m_buffer += type;
+        for (int i = 0; i < 5; ++i) {
+            m_buffer += separator;
+            append(*fields[i], m_format);
+        }
+        m_buffer += m_format == Tsv ? '\n' : '\0';
+    }
+    flushIfFull();
+}
+
+void Output::entry(const QString &path, const QString &key, const QString &value, const QString &layer)
+{
+    if (!isText()) {
+        record("entry", path, key, value);
+        if (!layer.isNull()) // its own record, so the columns of tsv and nul stay the same
+            record("layer", path, key, layer);
+        return;
+    }
+    append(key, Text);
+    m_buffer += ": ";
+    append(value, Text);
+    if (!layer.isNull()) {
+        m_buffer += "  [";
+        append(layer, Text);
+        m_buffer += ']';
+    }
+    m_buffer += '\n';
+    flushIfFull();
+}
+
+void Output::name(const char *type, const QString &path, const QString &name)
+{
+    if (!isText())
+        return record(type, path, name);
+    append(name, Text);
+    m_buffer += '\n';
+    flushIfFull();
+}
+
+void Output::added(const QString &path, const QString &key, const QString &value)
+{
+    if (!isText())
+        return record("added", path, key, value);
+    m_buffer += "New ";
+    entry(path, key, value);
+}
+
+void Output::changed(const QString &path, const QString &key, const QString &oldValue, const QString &newKey, const QString &value)
+{
+    if (!isText())
+        return record("changed", path, newKey.isNull() ? key : newKey, value, key, oldValue);
+    append(key, Text);
+    m_buffer += ": ";
+    append(oldValue, Text);
+    m_buffer += " -> ";
+    if (!newKey.isNull()) {
+        append(newKey, Text);
+        m_buffer += ": ";
+    }
+    append(value, Text);
+    m_buffer += '\n';
+    flushIfFull();
+}
+
+void Output::removed(const QString &path, const QString &key, const QString &value)
+{
+    if (!isText())
+        return record("removed", path, key, value);
+    m_buffer += "Removed ";
+    entry(path, key, value);
+}
+
+void Output::error(const QString &path, const QString &message)
+{
+    if (!isText())
+        return record("error", path, QString(), message);
+    append(message, Text);
+    m_buffer += '\n';
+    flushIfFull();
+}
+
+static Output::Format gs_format = Output::Text;
+static Output gs_stdout(Output::Text, &std::cout);
+static Output *gs_out = &gs_stdout; // the server redirects this into the reply for its client
+static QThreadStorage<Output*> gs_workerOut; // every worker of a multi file query has its own buffer
+
+inline Output &out() { return gs_workerOut.hasLocalData() ? *gs_workerOut.localData() : *gs_out; }
 
 void usage() {
     std::cout << "kconfig <component>[/<group>[/<subgroup>[...]]] read|write|delete|list|replace [<key>] [<value>]\n"
@@ -52,12 +388,93 @@ void usage() {
                 "  like list, but does not show values (for autocompletion)\n"
                 "* listgroups [<key>]\n"
                 "  like list, but only shows (sub)groups (for autocompletion)\n"
+                "* cas <key> <expected> <new>\n"
+                "  sets <key> to <new> if its value is <expected> (\"\" for a missing key), fails otherwise\n"
+                "* incr <key> [<delta>]\n"
+                "  adds <delta> (default 1) to the number in <key>, a missing key counts as 0\n"
+                "* setdefault <key> <value>\n"
+                "  sets <key> to <value> unless it exists already\n"
+                "* copygroup <component>/<group>\n"
+                "  copies the (sub)group with all its entries and subgroups to the new group <component>/<group>\n"
+                "* movegroup <component>/<group>\n"
+                "  like copygroup, but removes the original\n"
+                "* renamegroup <name>\n"
+                "  renames the (sub)group, it keeps its place in the tree\n"
+                "* compact [--dry-run]\n"
+                "  removes the entries of the user's file that the system wide files or kdeglobals set to the same\n"
+                "  value anyway, and the groups that end up empty. Use \"'*' compact\" for all components\n"
+                "* find <key> [<value>]\n"
+                "  prints all entries in the (sub)group and the groups below it whose key (and value) match\n"
+                "  the regular expressions, with their group paths\n"
+                "* watch [<key>]\n"
+                "  keeps running and prints the keys matching <key> (like list) that get added, changed or\n"
+                "  removed whenever a file of the component is rewritten\n"
                 "* replace <key> <value>\n"
                 "  replaces regular expression <key> with <value>, eg. \n"
-                "           kconfig MyApp/Group replace Item(.*)=Old(.*) Item\\1=New\\2\n";
+                "           kconfig MyApp/Group replace Item(.*)=Old(.*) Item\\1=New\\2\n"
+                "\n"
+                "A \"**\" group matches any number of nested groups, eg. \"plasma-appletsrc/**/General\"\n"
+                "\n"
+                "<component> may start with a wildcard pattern (eg. \"*rc/General\") to query all matching files\n"
+                "of the config search path in parallel\n"
+                "\n"
+                "--format=text|json|tsv|nul in front of any command selects the output format. The machine readable\n"
+                "formats print one record per result with the fields type, path, key, value, oldkey and oldvalue:\n"
+                "JSON objects, one per line, tab separated lines or NUL terminated fields\n"
+                "\n"
+                "--fast (after --format) lets read, list, listkeys and listgroups scan the mapped files directly\n"
+                "instead of loading them through KConfig, files using $e, $d or $a entries still go through KConfig.\n"
+                "--verify runs the command both ways and fails if the results differ\n"
+                "\n"
+                "--layer=user|system|all reads only the user's file, only the system wide files (read-only) or\n"
+                "the whole cascade (the default). --no-globals leaves out kdeglobals, which the user and system layers\n"
+                "always do. --show-layer makes list print the file every value comes from\n"
+                "\n"
+                "--stats[=json] prints the time spent loading, parsing, querying, printing and syncing, the number\n"
+                "of files, visited groups and pattern matches and the I/O of the call to stderr when it's done\n"
+                "\n"
+                "kconfig --batch [--atomic] [<file>]\n"
+                "  reads one \"<component>[/<group>[...]] <command> [<key>] [<value>]\" per line from <file>\n"
+                "  (or stdin), arguments can be quoted. Every touched file is written once at the end,\n"
+                "  compact runs after that.\n"
+                "  With --atomic, the first failing command aborts the batch and nothing is written\n"
+                "\n"
+                "kconfig --components [<filter>]\n"
+                "  lists the components (config files) containing <filter> (for autocompletion)\n"
+                "\n"
+                "kconfig snapshot <directory>|<component> > <file>\n"
+                "  writes all groups and entries of the files in <directory> (or the <component> as KConfig\n"
+                "  sees it) in a compact sorted format\n"
+                "\n"
+                "kconfig diff <before> <after>\n"
+                "  prints the entries that were added, changed or removed between two snapshots\n"
+                "\n"
+                "kconfig serve\n"
+                "  keeps parsed configs in memory and answers the read, list, listkeys, listgroups and find calls of\n"
+                "  this user with the same locale and config dirs, which transparently use it while it is running\n"
+                "  (export KCONFIG_NO_SERVER=1 to bypass it)\n";
 }
 
-enum Mode { Invalid = 0, Read, Write, List, ListKeys, ListGroups, Replace, Delete, DeleteGroup };
+enum Mode { Invalid = 0, Read, Write, List, ListKeys, ListGroups, Replace, Delete, DeleteGroup, Watch, Find, Cas, Incr, SetDefault, CopyGroup, MoveGroup, RenameGroup, Compact };
+enum Status { Continue = 0, Done, Failed };
+
+// where copygroup and movegroup put the group, set up by execute()
+struct CopyTarget
+{
+    CopyTarget() : config(0) {}
+    QString file;
+    QStringList groups;
+    KConfig *config;
+};
+static CopyTarget *gs_copyTarget = 0;
+// the files movegroup moved groups into, a batch writes them before the files the groups came from
+static QStringList gs_syncFirst;
+// compact rewrites the file itself, a batch runs it once its own changes are written (file, dry run)
+static QList<QPair<QString, bool> > gs_compacts;
+
+// (group path, key) -> value of everything the watch command looks at
+typedef QMap<QPair<QString, QString>, QString> EntryState;
+static EntryState *gs_watched = 0;
 
 QString path(KConfigGroup group)
 {
@@ -70,164 +487,548 @@ QString path(KConfigGroup group)
     return ret;
 }
 
-void process(Mode mode, KConfigGroup &grp, QString key, QString value)
+/**
+ * A case insensitive pattern that has to match entire strings, like QRegExp::exactMatch().
+ * Plain names, prefixes ("Name.*") and globs ("Applet.*s") are compared directly,
+ * only real regular expressions go through QRegExp - which is then set up once per query.
+ */
+class Pattern
+{
+public:
+    enum Type { Literal = 0, Prefix, Glob, RegExp, Recursive }; // Recursive is "**", any number of groups
+    Pattern(const QString &pattern = QString());
+    bool matches(const QString &string) const;
+    Type type() const { return m_type; }
+    const QString &pattern() const { return m_pattern; }
+    const QString &literal() const { return m_parts.first(); } // for Literal and Prefix
+private:
+    Type m_type;
+    QString m_pattern;
+    QStringList m_parts; // the literal parts around ".*"
+    QRegExp m_regExp;
+};
+
+Pattern::Pattern(const QString &pattern) : m_type(Literal), m_pattern(pattern)
+{
+    if (pattern == "**") {
+        m_type = Recursive;
+        return;
+    }
+    static const QString special("\\^$.|?*+()[]{}");
+    QString part;
+    for (int i = 0; i < pattern.length(); ++i) {
+        const QChar c = pattern.at(i);
+        if (c == '\\' && i + 1 < pattern.length() && special.contains(pattern.at(i + 1))) {
+            part += pattern.at(++i);
+        } else if (c == '.' && i + 1 < pattern.length() && pattern.at(i + 1) == '*') {
+            m_parts << part;
+            part.clear();
+            ++i;
+        } else if (special.contains(c)) {
+            m_type = RegExp;
+            m_regExp = QRegExp(pattern, Qt::CaseInsensitive);
+            m_parts.clear();
+            return;
+        } else {
+            part += c;
+        }
+    }
+    m_parts << part;
+    if (m_parts.count() == 1)
+        m_type = Literal;
+    else if (m_parts.count() == 2 && m_parts.last().isEmpty())
+        m_type = Prefix;
+    else
+        m_type = Glob;
+}
+
+bool Pattern::matches(const QString &string) const
+{
+    COUNT(matches);
+    switch (m_type) {
+    case Recursive:
+        return true;
+    case Literal:
+        return !string.compare(m_parts.first(), Qt::CaseInsensitive);
+    case Prefix:
+        return string.startsWith(m_parts.first(), Qt::CaseInsensitive);
+    case Glob: {
+        const QString &first = m_parts.first(), &last = m_parts.last();
+        if (string.length() < first.length() + last.length() ||
+            !string.startsWith(first, Qt::CaseInsensitive) || !string.endsWith(last, Qt::CaseInsensitive))
+            return false;
+        // the leftmost occurrence of every inner part is the best choice, so this never backtracks
+        int pos = first.length();
+        const int end = string.length() - last.length();
+        for (int i = 1; i < m_parts.count() - 1; ++i) {
+            const QString &part = m_parts.at(i);
+            if (part.isEmpty())
+                continue;
+            pos = string.indexOf(part, pos, Qt::CaseInsensitive);
+            if (pos < 0 || pos + part.length() > end)
+                return false;
+            pos += part.length();
+        }
+        return true;
+    }
+    default:
+        COUNT(regExps);
+        return m_regExp.exactMatch(string);
+    }
+}
+
+QList<Pattern> patterns(const QStringList &strings)
+{
+    QList<Pattern> ret;
+    foreach (const QString &string, strings)
+        ret << Pattern(string);
+    return ret;
+}
+
+// in batch mode all changes are written at once when the batch is done
+void sync(KConfigGroup &grp)
+{
+    if (!gs_batch) {
+        StatsTimer timer(&Stats::sync);
+        COUNT(syncs);
+        grp.sync();
+    }
+}
+
+QStringList cascade(const QString &file);
+
+// every KConfig is created here, so --stats can count the parsing
+KConfig *openConfig(const QString &file, KConfig::OpenFlags flags = KConfig::FullConfig)
+{
+    if (gs_stats) {
+        foreach (const QString &path, flags == KConfig::SimpleConfig ? QStringList(file) : cascade(file)) {
+            if (QFile::exists(path))
+                COUNT(files);
+        }
+    }
+    StatsTimer timer(&Stats::parse);
+    if (flags != KConfig::FullConfig || file.startsWith('/'))
+        return new KConfig(file, flags);
+    if (gs_layer == UserLayer)
+        return new KConfig(KStandardDirs::locateLocal("config", file), KConfig::SimpleConfig);
+    if (gs_layer == SystemLayer) // see selectLayer()
+        return new KConfig(file, KConfig::NoGlobals, "kconfig-system");
+    return new KConfig(file, gs_noGlobals ? KConfig::NoGlobals : KConfig::FullConfig);
+}
+
+// the system layer is the "config" resource without the user's directory, KConfig reads it as its own resource type
+void selectLayer(Layer layer)
+{
+    gs_layer = layer;
+    if (layer != SystemLayer)
+        return;
+    const QString local = KStandardDirs::locateLocal("config", QString());
+    foreach (const QString &dir, KGlobal::dirs()->resourceDirs("config")) {
+        if (dir != local)
+            KGlobal::dirs()->addResourceDir("kconfig-system", dir, false);
+    }
+}
+
+// the names of grp and its parents, from the toplevel group down
+QStringList groupNames(KConfigGroup grp)
+{
+    QStringList names;
+    for (; grp.isValid() && grp.name() != "<default>"; grp = grp.parent())
+        names.prepend(grp.name());
+    return names;
+}
+
+/**
+ * Finds the file of the cascade a value comes from for --show-layer: the first file, by priority, that
+ * has the key in that group. The files are parsed on their own, when they're needed.
+ */
+class LayerLookup
+{
+public:
+    LayerLookup(const QString &name);
+    ~LayerLookup() { qDeleteAll(m_configs); }
+    QString source(const KConfigGroup &grp, const QString &key);
+private:
+    QStringList m_files;
+    QList<KConfig*> m_configs;
+};
+
+LayerLookup::LayerLookup(const QString &name)
+{
+    if (name.startsWith('/') || gs_layer == UserLayer) {
+        m_files << (name.startsWith('/') ? name : KStandardDirs::locateLocal("config", name));
+        return;
+    }
+    m_files = KGlobal::dirs()->findAllResources("config", name); // the local file first
+    if (gs_layer == SystemLayer)
+        m_files.removeAll(KStandardDirs::locateLocal("config", name));
+    else if (!gs_noGlobals && name != "kdeglobals")
+        m_files << KGlobal::dirs()->findAllResources("config", "kdeglobals") << "/etc/kderc";
+}
+
+QString LayerLookup::source(const KConfigGroup &grp, const QString &key)
+{
+    const QStringList names = groupNames(grp);
+    for (int i = 0; i < m_files.count(); ++i) {
+        if (i == m_configs.count())
+            m_configs << new KConfig(m_files.at(i), KConfig::SimpleConfig);
+        KConfigGroup g = m_configs.at(i)->group(QString());
+        foreach (const QString &name, names)
+            g = g.group(name);
+        if (g.hasKey(key))
+            return m_files.at(i);
+    }
+    return QString();
+}
+
+// the number of entries of grp and its subgroups
+int entryCount(const KConfigGroup &grp)
+{
+    int entries = grp.keyList().count();
+    foreach (const QString &name, grp.groupList())
+        entries += entryCount(grp.group(name));
+    return entries;
+}
+
+// what processGroup() carries along while it walks the groups of one command
+struct Walk
+{
+    Walk() : recursive(false) {}
+    // below a **: most groups don't match the rest of the path, that's not worth a message, and
+    // a group without entries of its own is just the parent of its subgroups
+    bool recursive;
+    QSet<QString> found; // the groups find printed, a ** leads there again through their parents
+};
+
+// prints the entries of grp and all groups below it whose key and value match, for find
+void findEntries(const KConfigGroup &grp, bool root, const Pattern &keyMatch, const Pattern *valueMatch, QSet<QString> &found)
+{
+    COUNT(groups);
+    const QString name = groupNames(grp).join(QString(QChar(0x1d)));
+    if (found.contains(name))
+        return;
+    found << name;
+    if (grp.exists()) {
+        QString groupPath;
+        const QMap<QString, QString> map = grp.entryMap();
+        for (QMap<QString, QString>::const_iterator it = map.constBegin(), end = map.constEnd(); it != end; ++it) {
+            if (!keyMatch.matches(it.key()) || (valueMatch && !valueMatch->matches(it.value())))
+                continue;
+            if (groupPath.isNull()) {
+                groupPath = path(grp);
+                out() << "\n" << groupPath << gs_separator << "\n";
+            }
+            out().entry(groupPath, it.key(), it.value());
+        }
+    }
+    foreach (const QString &name, root ? grp.config()->groupList() : grp.groupList())
+        findEntries(grp.group(name), false, keyMatch, valueMatch, found);
+}
+
+Status process(Mode mode, KConfigGroup &grp, QString key, QString value, const QString &newValue, Walk &walk)
 {
     switch (mode) {
     case Read:
-        if (IS_A_TTY(1))
-            std::cout << CHAR(key) << ": " << CHAR(grp.readEntry(key, "does not exist")) << " (" << CHAR(path(grp)) << ")" << std::endl;
-        else
-            std::cout << CHAR(grp.readEntry(key, ""));
+        if (!out().isText()) {
+            if (grp.hasKey(key))
+                out().entry(path(grp), key, grp.readEntry(key));
+        } else if (gs_tty || gs_printPath) {
+            out() << key << ": " << grp.readEntry(key, "does not exist") << " (" << path(grp) << ")\n";
+        } else {
+            out() << grp.readEntry(key, "");
+            if (gs_batch)
+                out() << "\n";
+        }
         break;
     case Write: {
         if (grp.isImmutable()) {
-            std::cout << "The component/group " << CHAR(path(grp)) << " cannot be modified" << std::endl;
-            exit(1);
+            out().error(path(grp), "The component/group " + path(grp) + " cannot be modified");
+            return Failed;
         }
         bool added = !grp.hasKey(key);
         QString oldv;
         if (!added) oldv = grp.readEntry(key);
         grp.writeEntry(key, QString(value));
-        grp.sync();
+        sync(grp);
+        if (added)
+            out().added(path(grp), key, grp.readEntry(key));
+        else
+            out().changed(path(grp), key, oldv, QString(), grp.readEntry(key));
+        break;
+    }
+    case Cas:
+    case Incr:
+    case SetDefault: {
+        if (grp.isImmutable()) {
+            out().error(path(grp), "The component/group " + path(grp) + " cannot be modified");
+            return Failed;
+        }
+        // the file is locked since it was parsed, so nobody can change the value between reading and writing it
+        const bool added = !grp.hasKey(key);
+        const QString oldv = grp.readEntry(key, QString());
+        QString newv;
+        if (mode == Cas) {
+            if (oldv != value) { // a missing key is ""
+                out().error(path(grp), key + " is \"" + oldv + "\", not \"" + value + "\"");
+                return Failed;
+            }
+            newv = newValue;
+        } else if (mode == Incr) {
+            bool ok = true, deltaOk = true;
+            const qlonglong current = added ? 0 : oldv.toLongLong(&ok);
+            const qlonglong delta = value.isEmpty() ? 1 : value.toLongLong(&deltaOk);
+            if (!ok || !deltaOk) {
+                out().error(path(grp), "Not a number: " + (ok ? value : oldv));
+                return Failed;
+            }
+            newv = QString::number(current + delta);
+        } else {
+            if (!added) { // nothing to do, but tell the value
+                out().entry(path(grp), key, oldv);
+                break;
+            }
+            newv = value;
+        }
+        grp.writeEntry(key, newv);
+        sync(grp);
         if (added)
-            std::cout << "New " << CHAR(key) << ": " << CHAR(grp.readEntry(key)) << std::endl;
+            out().added(path(grp), key, grp.readEntry(key));
         else
-            std::cout << CHAR(key) << ": " << CHAR(oldv) << " -> " << CHAR(grp.readEntry(key)) << std::endl;
+            out().changed(path(grp), key, oldv, QString(), grp.readEntry(key));
+        break;
+    }
+    case CopyGroup:
+    case MoveGroup:
+    case RenameGroup: {
+        if (!grp.exists() && grp.groupList().isEmpty()) {
+            out().error(path(grp), "There's no group " + path(grp));
+            return Failed;
+        }
+        if (mode != CopyGroup && grp.isImmutable()) {
+            out().error(path(grp), "The component/group " + path(grp) + " cannot be modified");
+            return Failed;
+        }
+        KConfigGroup target;
+        if (mode == RenameGroup) {
+            const KConfigGroup parent = grp.parent();
+            target = parent.isValid() ? parent.group(key) : grp.config()->group(key);
+        } else {
+            target = gs_copyTarget->config->group(gs_copyTarget->groups.first());
+            for (int i = 1; i < gs_copyTarget->groups.count(); ++i)
+                target = target.group(gs_copyTarget->groups.at(i));
+        }
+        if (target.exists() || !target.groupList().isEmpty()) {
+            out().error(path(target), "The group " + path(target) + " exists already");
+            return Failed;
+        }
+        if (target.isImmutable()) {
+            out().error(path(target), "The component/group " + path(target) + " cannot be modified");
+            return Failed;
+        }
+        const QString from = path(grp);
+        const QStringList names = groupNames(grp);
+        if (mode != RenameGroup && target.config() == grp.config() && gs_copyTarget->groups.mid(0, names.count()) == names) {
+            out().error(from, "Cannot " + QString(mode == CopyGroup ? "copy" : "move") + " " + from + " into itself");
+            return Failed;
+        }
+        // copyTo() takes the entries as KConfig has them, with their translations and $e flags. reparent()
+        // would keep the name, so renamegroup is a copy as well
+        const int entries = entryCount(grp);
+        grp.copyTo(&target);
+        if (target.config() == grp.config()) {
+            if (mode != CopyGroup)
+                grp.deleteGroup();
+            sync(target);
+        } else {
+            sync(target); // written before the original is gone
+            if (mode == MoveGroup) {
+                if (!target.config()->isConfigWritable(false)) {
+                    out().error(path(target), "Cannot write " + path(target) + ", " + from + " was not removed");
+                    return Failed;
+                }
+                grp.deleteGroup();
+                sync(grp);
+                if (gs_batch && !gs_syncFirst.contains(gs_copyTarget->file))
+                    gs_syncFirst << gs_copyTarget->file;
+            }
+        }
+        const QString to = path(target);
+        static const char *types[3] = { "copiedgroup", "movedgroup", "renamedgroup" };
+        static const char *verbs[3] = { "Copied ", "Moved ", "Renamed " };
+        out() << verbs[mode - CopyGroup] << from << " to " << to << " (" << QString::number(entries) << " entries)\n";
+        out().record(types[mode - CopyGroup], from, QString(), to);
         break;
     }
     case Delete: {
         if (grp.isImmutable()) {
-            std::cout << "The component/group " << CHAR(path(grp)) << " cannot be modified" << std::endl;
-            exit(1);
+            out().error(path(grp), "The component/group " + path(grp) + " cannot be modified");
+            return Failed;
         }
         if (grp.hasKey(key)) {
-            std::cout << "Removed " << CHAR(key) << ": " << CHAR(grp.readEntry(key)) << std::endl;
+            out().removed(path(grp), key, grp.readEntry(key));
             grp.deleteEntry(key);
-            grp.sync();
+            sync(grp);
         } else if (grp.hasGroup(key)) {
-            std::cout << "There's a group, but no key: " << CHAR(key) << "\nPlease explicitly use deletegroup" << std::endl;
-            exit(1);
+            out().error(path(grp), "There's a group, but no key: " + key + "\nPlease explicitly use deletegroup");
+            return Failed;
         } else {
-            std::cout << "There's no key " << CHAR(key) << " in " << CHAR(path(grp)) << std::endl;
-            exit(1);
+            out().error(path(grp), "There's no key " + key + " in " + path(grp));
+            return Failed;
         }
         break;
     }
     case DeleteGroup: {
         if (grp.hasGroup(key)) {
+            const QString parentPath = path(grp);
             grp = grp.group(key);
             if (grp.isImmutable()) {
-                std::cout << "The component/group " << CHAR(path(grp)) << " cannot be modified" << std::endl;
-                exit(1);
+                out().error(path(grp), "The component/group " + path(grp) + " cannot be modified");
+                return Failed;
             }
             QMap<QString, QString> map = grp.entryMap();
-            std::cout << "Removed " << CHAR(key) << gs_separator << std::endl;
+            out() << "Removed " << key << gs_separator << "\n";
+            out().record("removedgroup", parentPath, key);
+            const QString groupPath = out().isText() ? QString() : path(grp);
             for (QMap<QString, QString>::const_iterator it = map.constBegin(), end = map.constEnd(); it != end; ++it) {
-                std::cout << CHAR(it.key()) << ": " << CHAR(it.value()) << std::endl;
+                if (out().isText())
+                    out().entry(groupPath, it.key(), it.value());
+                else
+                    out().removed(groupPath, it.key(), it.value());
             }
             grp.deleteGroup();
-            grp.sync();
+            sync(grp);
         } else {
-            std::cout << "There's no group " << CHAR(key) << " in " << CHAR(path(grp)) << std::endl;
-            exit(1);
+            out().error(path(grp), "There's no group " + key + " in " + path(grp));
+            return Failed;
         }
         break;
     }
     case List:
     case ListKeys: {
+        if (!grp.exists() && walk.recursive) // the ** lists its subgroups on its own
+            break;
         if (!grp.exists()) { // could be parent group
             if (mode == ListKeys)
-                exit(1);
+                return Failed;
             QStringList groups = grp.parent().exists() ? grp.parent().groupList() : grp.config()->groupList();
             if (groups.isEmpty()) {
-                std::cout << "The component/group " << CHAR(path(grp)) << " does not exist" << std::endl;
-                exit(1);
+                out().error(path(grp), "The component/group " + path(grp) + " does not exist");
+                return Failed;
             }
-            std::cout << "Groups in " << CHAR(path(grp)) << gs_separator << std::endl;
+            const QString groupPath = path(grp);
+            out() << "Groups in " << groupPath << gs_separator << "\n";
             foreach (const QString &s, groups)
                 if (key.isEmpty() || s.contains(key, Qt::CaseInsensitive))
-                    std::cout << CHAR(s) << std::endl;
-            exit(0);
+                    out().name("group", groupPath, s);
+            return Done;
         }
 
+        // with many groups the misses would drown the hits
+        const bool quiet = walk.recursive || gs_multiFile;
         QMap<QString, QString> map = grp.entryMap();
         if (map.isEmpty()) {
-            std::cout << "The group " << CHAR(path(grp)) << " is empty" << std::endl;
+            if (!quiet)
+                out() << "The group " << path(grp) << " is empty\n";
             break;
         }
 
+        const QString groupPath = path(grp);
         if (mode == List) {
             bool matchFound = false;
+            LayerLookup *layers = gs_showLayer ? new LayerLookup(grp.config()->name()) : 0;
             for (QMap<QString, QString>::const_iterator it = map.constBegin(), end = map.constEnd(); it != end; ++it) {
                 if (key.isEmpty() || it.key().contains(key, Qt::CaseInsensitive)) {
                     if (!matchFound)
-                        std::cout << std::endl << CHAR(path(grp)) << gs_separator << std::endl;
+                        out() << "\n" << groupPath << gs_separator << "\n";
                     matchFound = true;
-                    std::cout << CHAR(it.key()) << ": " << CHAR(it.value()) << std::endl;
+                    out().entry(groupPath, it.key(), it.value(), layers ? layers->source(grp, it.key()) : QString());
                 }
             }
+            delete layers;
 
-            if (!matchFound)
-                std::cout << "No present key matches \"" << CHAR(key) << "\" in " << CHAR(path(grp));
-            std::cout << std::endl;
+            if (!matchFound && !quiet)
+                out() << "No present key matches \"" << key << "\" in " << groupPath;
+            if (matchFound || !quiet)
+                out() << "\n";
         } else {
             for (QMap<QString, QString>::const_iterator it = map.constBegin(), end = map.constEnd(); it != end; ++it) {
                 if (key.isEmpty() || it.key().contains(key, Qt::CaseInsensitive)) {
-                    std::cout << CHAR(it.key()) << std::endl;
+                    out().name("key", groupPath, it.key());
                 }
             }
         }
         break;
     }
+    case Find: {
+        const Pattern keyMatch(key), valueMatch(value);
+        findEntries(grp, grp.name() == "<default>", keyMatch, value.isNull() ? 0 : &valueMatch, walk.found);
+        break;
+    }
+    case Watch: {
+        if (!gs_watched) {
+            out().error(path(grp), "watch can only be used on its own");
+            return Failed;
+        }
+        if (!grp.exists())
+            break;
+        const QString groupPath = path(grp);
+        QMap<QString, QString> map = grp.entryMap();
+        for (QMap<QString, QString>::const_iterator it = map.constBegin(), end = map.constEnd(); it != end; ++it) {
+            if (key.isEmpty() || it.key().contains(key, Qt::CaseInsensitive))
+                gs_watched->insert(qMakePair(groupPath, it.key()), it.value());
+        }
+        break;
+    }
     case ListGroups: {
         QStringList groups = grp.parent().exists() ? grp.parent().groupList() : grp.config()->groupList();
+        const QString parentPath = out().isText() ? QString() : path(grp.parent());
         foreach (const QString &s, groups)
             if (key.isEmpty() || s.contains(key, Qt::CaseInsensitive))
-                std::cout << CHAR(s) << std::endl;
-        exit(0);
+                out().name("group", parentPath, s);
+        return Done;
     }
     case Replace: {
         if (grp.isImmutable()) {
-            std::cout << "The component/group " << CHAR(path(grp)) << " cannot be modified" << std::endl;
-            exit(1);
+            out().error(path(grp), "The component/group " + path(grp) + " cannot be modified");
+            return Failed;
         }
         QStringList match = key.split("=");
         if (match.count() != 2) {
-            std::cout << "The match sequence must be of the form <key regexp>=<value regexp>" << std::endl;
-            exit(1);
+            out().error(path(grp), "The match sequence must be of the form <key regexp>=<value regexp>");
+            return Failed;
         }
-        QRegExp keyMatch(match.at(0), Qt::CaseInsensitive);
-        QRegExp valueMatch(match.at(1), Qt::CaseInsensitive);
         QStringList replace = value.split("=");
         if (replace.count() != 2) {
-            std::cout << "The replace sequence must be of the form <key string>=<value string>" << std::endl;
-            exit(1);
+            out().error(path(grp), "The replace sequence must be of the form <key string>=<value string>");
+            return Failed;
         }
+        // the patterns pick the entries, QRegExp only runs for those. Like it always did, it replaces every
+        // match in the key and the value, \1 .. \9 refer to the captures of each
+        const Pattern keyMatch(match.at(0)), valueMatch(match.at(1));
+        const QRegExp keyRegExp(match.at(0), Qt::CaseInsensitive), valueRegExp(match.at(1), Qt::CaseInsensitive);
         QMap<QString, QString> map = grp.entryMap();
         QStringList keys;
         for (QMap<QString, QString>::const_iterator it = map.constBegin(), end = map.constEnd(); it != end; ++it) {
-            if (keyMatch.exactMatch(it.key()) && valueMatch.exactMatch(it.value())) {
+            if (keyMatch.matches(it.key()) && valueMatch.matches(it.value()))
                 keys << it.key();
-            }
         }
         foreach (const QString &key, keys) {
-            QString newKey = key;
-            newKey.replace(keyMatch, replace.at(0));
-            QString newValue = grp.readEntry(key);
-            const QString oldValue = newValue;
-            newValue.replace(valueMatch, replace.at(1));
+            const QString oldValue = map.value(key);
+            const QString newKey = QString(key).replace(keyRegExp, replace.at(0));
             if (key != newKey)
                 grp.deleteEntry(key);
-            grp.writeEntry(newKey, newValue);
-            std::cout << CHAR(key) << ": " << CHAR(oldValue) << " -> " << CHAR(newKey) << ": " << CHAR(grp.readEntry(newKey)) << std::endl;
-            grp.sync();
+            grp.writeEntry(newKey, QString(oldValue).replace(valueRegExp, replace.at(1)));
+            out().changed(path(grp), key, oldValue, newKey, grp.readEntry(newKey));
         }
+        if (!keys.isEmpty())
+            sync(grp);
         break;
     }
     Invalid:
     default:
         break;
     }
+    return Continue;
 }
 #if 0
 void process(Mode mode, QSettings &set, QString key, QString value)
@@ -362,26 +1163,26 @@ Mode checkMode(QString modekey, int argc) {
     Mode mode(Invalid);
     if (modekey == "read" || modekey == "get") {
         if (argc < 4) {
-            std::cout << "You must say what <key> to read" << std::endl;
-            exit(1);
+            out().error(QString(), "You must say what <key> to read");
+            return Invalid;
         }
         mode = Read;
     } else if (modekey == "write" || modekey == "set") {
         if (argc < 5) {
-            std::cout << "You must say what <key> to write to what <value>" << std::endl;
-            exit(1);
+            out().error(QString(), "You must say what <key> to write to what <value>");
+            return Invalid;
         }
         mode = Write;
     } else if (modekey == "delete") {
         if (argc < 4) {
-            std::cout << "You must say what key to delete" << std::endl;
-            exit(1);
+            out().error(QString(), "You must say what key to delete");
+            return Invalid;
         }
         mode = Delete;
     } else if (modekey == "deletegroup") {
         if (argc < 4) {
-            std::cout << "You must say what group to delete" << std::endl;
-            exit(1);
+            out().error(QString(), "You must say what group to delete");
+            return Invalid;
         }
         mode = DeleteGroup;
     } else if (modekey == "list") {
@@ -390,34 +1191,107 @@ Mode checkMode(QString modekey, int argc) {
         mode = ListKeys;
     } else if (modekey == "listgroups") {
         mode = ListGroups;
+    } else if (modekey == "cas") {
+        if (argc < 6) {
+            out().error(QString(), "You must say what <key> to set from what <expected> value to what <new> value");
+            return Invalid;
+        }
+        mode = Cas;
+    } else if (modekey == "incr") {
+        if (argc < 4) {
+            out().error(QString(), "You must say what <key> to increment");
+            return Invalid;
+        }
+        mode = Incr;
+    } else if (modekey == "setdefault") {
+        if (argc < 5) {
+            out().error(QString(), "You must say what <key> to set to what <value>");
+            return Invalid;
+        }
+        mode = SetDefault;
+    } else if (modekey == "copygroup" || modekey == "movegroup") {
+        if (argc < 4) {
+            out().error(QString(), "You must say to what <component>/<group> to " + modekey.left(4) + " the group");
+            return Invalid;
+        }
+        mode = modekey == "copygroup" ? CopyGroup : MoveGroup;
+    } else if (modekey == "renamegroup") {
+        if (argc < 4) {
+            out().error(QString(), "You must say the new <name> of the group");
+            return Invalid;
+        }
+        mode = RenameGroup;
+    } else if (modekey == "compact") {
+        mode = Compact;
+    } else if (modekey == "find") {
+        if (argc < 4) {
+            out().error(QString(), "You must say what <key> to find");
+            return Invalid;
+        }
+        mode = Find;
+    } else if (modekey == "watch") {
+        mode = Watch;
     } else if (modekey == "replace") {
         if (argc < 5) {
-            std::cout << "You must say <what regexp> to replace by <what string>" << std::endl;
-            exit(1);
+            out().error(QString(), "You must say <what regexp> to replace by <what string>");
+            return Invalid;
         }
         mode = Replace;
+    } else {
+        out().error(QString(), "Unknown command: " + modekey);
     }
     return mode;
 }
 
-void processGroup(KConfigGroup grp, QStringList component, int next, Mode mode, QString key, QString value) {
-    if (next == component.count()) {
-        process(mode, grp, key, value);
-        return;
-    }
+// newValue is the third argument of cas
+Status processGroup(KConfigGroup grp, const QList<Pattern> &component, int next, Mode mode, const QString &key, const QString &value,
+                    const QString &newValue, Walk &walk) {
+    COUNT(groups);
+    if (next == component.count())
+        return process(mode, grp, key, value, newValue, walk);
 
-    const QStringList groups = grp.exists() ? grp.groupList() : grp.config()->groupList();
-    const QRegExp groupMatch(component.at(next), Qt::CaseInsensitive);
+    // the root lists the toplevel groups, KConfigGroup::groupList() of <default> is empty
+    const bool root = grp.name() == "<default>";
+    const Pattern &groupMatch = component.at(next);
+    if (groupMatch.type() == Pattern::Recursive) {
+        // this group and everything below, where the ** stays in place. A group that does not exist
+        // only holds others, it's no match for the end of the path
+        const bool recursive = walk.recursive;
+        walk.recursive = true;
+        Status status = next + 1 < component.count() || grp.exists() ?
+                        processGroup(grp, component, next + 1, mode, key, value, newValue, walk) : Continue;
+        foreach (const QString &g, root ? grp.config()->groupList() : grp.groupList()) {
+            if (status != Continue)
+                break;
+            const KConfigGroup child = grp.group(g);
+            if (mode == Find && walk.found.contains(groupNames(child).join(QString(QChar(0x1d)))))
+                continue;
+            status = processGroup(child, component, next, mode, key, value, newValue, walk);
+        }
+        walk.recursive = recursive;
+        return status;
+    }
+    const QStringList groups = !root && (grp.exists() || walk.recursive) ? grp.groupList() : grp.config()->groupList();
     int hits = 0;
     foreach (const QString &g, groups) {
-        if (groupMatch.exactMatch(g)) {
+        if (groupMatch.matches(g)) {
             ++hits;
-            processGroup(grp.group(g), component, next + 1, mode, key, value);
+            const Status status = processGroup(grp.group(g), component, next + 1, mode, key, value, newValue, walk);
+            if (status != Continue)
+                return status;
         }
     }
-    if (!hits) {
-        std::cout << "No existing group matches " << CHAR(component.at(next)) << std::endl;
+    if (!hits && !walk.recursive && !gs_multiFile) {
+        out() << "No existing group matches " << groupMatch.pattern() << "\n";
     }
+    return Continue;
+}
+
+Status processGroup(KConfigGroup grp, const QList<Pattern> &component, Mode mode, const QString &key, const QString &value,
+                    const QString &newValue = QString())
+{
+    Walk walk;
+    return processGroup(grp, component, 0, mode, key, value, newValue, walk);
 }
 
 // void processGroup(QSettings &set, QStringList component, int next, Mode mode, QString key, QString value) {
@@ -437,35 +1311,2377 @@ void processGroup(KConfigGroup grp, QStringList component, int next, Mode mode,
 //     }
 // }
 
-int main (int argc, char **argv)
-{
-    if (argc < 3) {
-        usage();
-        exit(1);
+struct FileStamp {
+    qint64 mtime, size, inode;
+    bool operator==(const FileStamp &other) const {
+        return mtime == other.mtime && size == other.size && inode == other.inode;
     }
-    Mode mode = checkMode(QString::fromLocal8Bit(argv[2]), argc);
-    if (mode == Invalid) {
-        std::cout << "Unknown command: " << argv[2] << std::endl;
-        exit(1);
+};
+
+FileStamp fileStamp(const QString &path)
+{
+    FileStamp stamp = { -1, -1, -1 };
+    struct stat st;
+    if (!::stat(QFile::encodeName(path).constData(), &st)) {
+        stamp.mtime = st.st_mtime;
+        stamp.size = st.st_size;
+        stamp.inode = st.st_ino; // KSaveFile replaces the file, so the inode catches rewrites within a second
     }
+    return stamp;
+}
 
-    QString file = QString::fromLocal8Bit(argv[1]);
-    QStringList component = file.split('/', QString::SkipEmptyParts);
-    int firstGroupIndex = 1;
-    if (file.startsWith('/')) {
-        file = '/' + component.at(firstGroupIndex - 1);
-        while (firstGroupIndex < component.count() && QFile::exists(file + '/' + component.at(firstGroupIndex)))
-            file += '/' + component.at(firstGroupIndex++);
-    } else {
-        file = component.at(0);
+// all files that KConfig(file) reads or might read once they exist
+QStringList cascade(const QString &file)
+{
+    if (file.startsWith('/'))
+        return QStringList() << file;
+    QStringList files = KGlobal::dirs()->findAllResources("config", file);
+    files << KGlobal::dirs()->findAllResources("config", "kdeglobals");
+    files << KGlobal::dirs()->findAllResources("config", "system.kdeglobals");
+    const QString localFiles[2] = { KStandardDirs::locateLocal("config", file), KStandardDirs::locateLocal("config", "kdeglobals") };
+    for (int i = 0; i < 2; ++i) {
+        if (!files.contains(localFiles[i]))
+            files << localFiles[i];
     }
-    QString key, value;
-    if (argc > 2)
-        key = QString::fromLocal8Bit(argv[3]);
-    if (argc > 3)
-        value = QString::fromLocal8Bit(argv[4]);
-    KConfig cfg(file);
-    KConfigGroup grp = cfg.group(QString());
-    processGroup(grp, component, firstGroupIndex, mode, key, value);
-    exit(0);
+    return files;
+}
+
+QList<FileStamp> cascadeStamps(const QString &file)
+{
+    QList<FileStamp> stamps;
+    foreach (const QString &path, cascade(file))
+        stamps << fileStamp(path);
+    return stamps;
+}
+
+QString indexPath(const QString &name)
+{
+    return KStandardDirs::locateLocal("cache", "kconfig/" + QString(name).replace('/', '%') + ".idx");
 }
+
+void appendRecord(QByteArray &data, char tag, const QByteArray &value)
+{
+    data += tag;
+    data += value;
+    data += '\0';
+}
+
+QByteArray stampRecord(const QString &path, const FileStamp &stamp)
+{
+    return QByteArray::number(stamp.mtime) + ' ' + QByteArray::number(stamp.size) + ' ' +
+           QByteArray::number(stamp.inode) + ' ' + QFile::encodeName(path);
+}
+
+bool parseStampRecord(const char *record, QString &path, FileStamp &stamp)
+{
+    qlonglong mtime, size, inode;
+    int pathOffset = 0;
+    if (sscanf(record, "%lld %lld %lld %n", &mtime, &size, &inode, &pathOffset) != 3 || !pathOffset)
+        return false;
+    stamp.mtime = mtime;
+    stamp.size = size;
+    stamp.inode = inode;
+    path = QFile::decodeName(record + pathOffset);
+    return true;
+}
+
+// replaces the file at path with data at once, for the index files and compact
+bool saveFile(const QString &path, const QByteArray &data)
+{
+    KSaveFile file(path);
+    if (!file.open())
+        return false;
+    file.write(data);
+    return file.finalize();
+}
+
+/**
+ * The group tree and key names of a config, so completion does not have to parse the cascade.
+ * The file is mapped and consists of NUL terminated records with a one byte tag:
+ * F<mtime> <size> <inode> <path> - one for every file of the cascade, the index is stale if any changed
+ * R|r - the root group (r if it does not exist), followed by its keys
+ * G|g<depth>:<name> - a group (g if it does not exist), depth first, followed by
+ * K<name> - the keys of that group
+ */
+class CompletionIndex
+{
+public:
+    CompletionIndex(const QString &name);
+    ~CompletionIndex();
+    bool isValid() const { return m_valid; }
+    const QList<FileStamp> &stamps() const { return m_stamps; }
+    // the stamps must have been taken before cfg was parsed
+    static void write(const QString &name, const QList<FileStamp> &stamps, KConfig &cfg);
+    Status processGroup(int group, const QList<Pattern> &component, int next, Mode mode, const QString &key,
+                        bool recursive = false) const;
+    // find with the group tree and the key names from the index, cfg is only parsed once a key name matches
+    Status find(const QList<Pattern> &component, const QString &key, const QString &value, KConfig *&cfg);
+private:
+    static void writeGroup(QByteArray &data, const KConfigGroup &grp, int depth);
+    void findEntries(int group) const;
+    KConfigGroup configGroup(int group) const;
+    Status process(int group, Mode mode, const QString &key, bool recursive) const;
+    int firstChild(int group) const;
+    QString path(int group) const;
+    struct Group {
+        const char *name, *keys; // point into the mapped file
+        int keyCount, parent, firstChild, next;
+        bool exists;
+    };
+    QString m_name;
+    QStringList m_paths;
+    QList<FileStamp> m_stamps;
+    QFile m_file;
+    uchar *m_data;
+    QVector<Group> m_groups; // the root group is the first
+    bool m_valid;
+    // the query of find()
+    KConfig **m_config;
+    const Pattern *m_keyMatch, *m_valueMatch;
+    QSet<int> *m_found;
+};
+
+CompletionIndex::CompletionIndex(const QString &name) : m_name(name), m_data(0), m_valid(false),
+                                                        m_config(0), m_keyMatch(0), m_valueMatch(0), m_found(0)
+{
+    StatsTimer timer(&Stats::parse);
+    m_paths = cascade(name);
+    foreach (const QString &path, m_paths)
+        m_stamps << fileStamp(path);
+
+    m_file.setFileName(indexPath(name));
+    if (!m_file.open(QIODevice::ReadOnly) || m_file.size() < 6)
+        return;
+    COUNT(files);
+    const qint64 size = m_file.size();
+    m_data = m_file.map(0, size);
+    const char *data = reinterpret_cast<const char*>(m_data);
+    if (!data || memcmp(data, "KCIX1", 6) || data[size - 1] != '\0')
+        return;
+
+    int files = 0;
+    QVector<int> parents, lastChild; // parents[depth + 1] is the open group of that depth
+    for (const char *record = data + 6, *end = data + size; record < end; record += qstrlen(record) + 1) {
+        switch (*record) {
+        case 'F': {
+            QString path;
+            FileStamp stamp;
+            if (files >= m_paths.count() || !parseStampRecord(record + 1, path, stamp) ||
+                path != m_paths.at(files) || !(stamp == m_stamps.at(files)))
+                return; // stale
+            ++files;
+            break;
+        }
+        case 'R':
+        case 'r': {
+            if (!m_groups.isEmpty())
+                return;
+            const Group root = { record + 1, 0, 0, -1, -1, -1, *record == 'R' };
+            m_groups << root;
+            parents << 0;
+            lastChild << -1;
+            break;
+        }
+        case 'G':
+        case 'g': {
+            const int depth = atoi(record + 1);
+            const char *name = strchr(record, ':');
+            if (!name || m_groups.isEmpty() || depth < 0 || depth + 1 > parents.count())
+                return;
+            parents.resize(depth + 1);
+            const int parent = parents.last(), index = m_groups.count();
+            const Group group = { name + 1, 0, 0, parent, -1, -1, *record == 'G' };
+            m_groups << group;
+            lastChild << -1;
+            if (lastChild.at(parent) < 0)
+                m_groups[parent].firstChild = index;
+            else
+                m_groups[lastChild.at(parent)].next = index;
+            lastChild[parent] = index;
+            parents << index;
+            break;
+        }
+        case 'K': {
+            if (m_groups.isEmpty())
+                return;
+            Group &group = m_groups.last();
+            if (!group.keyCount++)
+                group.keys = record + 1;
+            break;
+        }
+        default:
+            return;
+        }
+    }
+    m_valid = files == m_paths.count() && !m_groups.isEmpty();
+}
+
+CompletionIndex::~CompletionIndex()
+{
+    if (m_data)
+        m_file.unmap(m_data);
+}
+
+void CompletionIndex::writeGroup(QByteArray &data, const KConfigGroup &grp, int depth)
+{
+    const QStringList keys = grp.exists() ? grp.entryMap().keys() : QStringList();
+    foreach (const QString &key, keys)
+        appendRecord(data, 'K', key.toUtf8());
+    const QStringList groups = depth < 0 ? (grp.exists() ? grp.groupList() : grp.config()->groupList()) : grp.groupList();
+    foreach (const QString &name, groups) {
+        const KConfigGroup child = grp.group(name);
+        appendRecord(data, child.exists() ? 'G' : 'g', QByteArray::number(depth + 1) + ':' + name.toUtf8());
+        writeGroup(data, child, depth + 1);
+    }
+}
+
+void CompletionIndex::write(const QString &name, const QList<FileStamp> &stamps, KConfig &cfg)
+{
+    const QStringList paths = cascade(name);
+    if (paths.count() != stamps.count())
+        return;
+    QByteArray data("KCIX1", 6);
+    for (int i = 0; i < paths.count(); ++i)
+        appendRecord(data, 'F', stampRecord(paths.at(i), stamps.at(i)));
+    const KConfigGroup root = cfg.group(QString());
+    appendRecord(data, root.exists() ? 'R' : 'r', QByteArray());
+    writeGroup(data, root, -1);
+    saveFile(indexPath(name), data);
+}
+
+// like KConfigGroup::groupList() - groups that do not exist list the toplevel groups in processGroup()
+int CompletionIndex::firstChild(int group) const
+{
+    return m_groups.at(m_groups.at(group).exists ? group : 0).firstChild;
+}
+
+// like path(KConfigGroup)
+QString CompletionIndex::path(int group) const
+{
+    QString ret;
+    for (; group > 0 && m_groups.at(group).exists; group = m_groups.at(group).parent)
+        ret.prepend("/" + QString::fromUtf8(m_groups.at(group).name));
+    ret.prepend(m_name);
+    return ret;
+}
+
+// mirrors ::processGroup()
+Status CompletionIndex::processGroup(int group, const QList<Pattern> &component, int next, Mode mode, const QString &key,
+                                     bool recursive) const
+{
+    COUNT(groups);
+    if (next == component.count())
+        return process(group, mode, key, recursive);
+
+    const Pattern &groupMatch = component.at(next);
+    if (groupMatch.type() == Pattern::Recursive) {
+        Status status = next + 1 < component.count() || m_groups.at(group).exists ?
+                        processGroup(group, component, next + 1, mode, key, true) : Continue;
+        for (int child = m_groups.at(group).firstChild; child > -1 && status == Continue; child = m_groups.at(child).next) {
+            if (mode != Find || !m_found->contains(child))
+                status = processGroup(child, component, next, mode, key, true);
+        }
+        return status;
+    }
+    int hits = 0;
+    for (int child = recursive ? m_groups.at(group).firstChild : firstChild(group); child > -1; child = m_groups.at(child).next) {
+        if (groupMatch.matches(QString::fromUtf8(m_groups.at(child).name))) {
+            ++hits;
+            const Status status = processGroup(child, component, next + 1, mode, key, recursive);
+            if (status != Continue)
+                return status;
+        }
+    }
+    if (!hits && !recursive && !gs_multiFile) {
+        out() << "No existing group matches " << groupMatch.pattern() << "\n";
+    }
+    return Continue;
+}
+
+Status CompletionIndex::find(const QList<Pattern> &component, const QString &key, const QString &value, KConfig *&cfg)
+{
+    const Pattern keyMatch(key), valueMatch(value);
+    QSet<int> found;
+    m_config = &cfg;
+    m_keyMatch = &keyMatch;
+    m_valueMatch = value.isNull() ? 0 : &valueMatch;
+    m_found = &found;
+    const Status status = processGroup(0, component, 0, Find, key);
+    m_config = 0;
+    m_keyMatch = m_valueMatch = 0;
+    m_found = 0;
+    return status;
+}
+
+// like ::findEntries(), but groups without a matching key name are skipped without looking at the config
+void CompletionIndex::findEntries(int group) const
+{
+    COUNT(groups);
+    if (m_found->contains(group))
+        return;
+    *m_found << group;
+    const Group &g = m_groups.at(group);
+    KConfigGroup grp;
+    QString groupPath;
+    const char *k = g.keys;
+    for (int i = 0; i < g.keyCount; ++i, k += qstrlen(k) + 2) {
+        const QString name = QString::fromUtf8(k);
+        if (!m_keyMatch->matches(name))
+            continue;
+        if (!grp.isValid())
+            grp = configGroup(group);
+        const QString value = grp.readEntry(name, QString());
+        if (m_valueMatch && !m_valueMatch->matches(value))
+            continue;
+        if (groupPath.isNull()) {
+            groupPath = path(group);
+            out() << "\n" << groupPath << gs_separator << "\n";
+        }
+        out().entry(groupPath, name, value);
+    }
+    for (int child = g.firstChild; child > -1; child = m_groups.at(child).next)
+        findEntries(child);
+}
+
+// the KConfigGroup for the same path, the cascade is parsed the first time one is needed
+KConfigGroup CompletionIndex::configGroup(int group) const
+{
+    if (!*m_config)
+        *m_config = openConfig(m_name);
+    QStringList names;
+    for (int g = group; g > 0; g = m_groups.at(g).parent)
+        names.prepend(QString::fromUtf8(m_groups.at(g).name));
+    KConfigGroup cg = (*m_config)->group(QString());
+    foreach (const QString &name, names)
+        cg = cg.group(name);
+    return cg;
+}
+
+// mirrors ::process() for ListKeys, ListGroups and Find
+Status CompletionIndex::process(int group, Mode mode, const QString &key, bool recursive) const
+{
+    const Group &grp = m_groups.at(group);
+    if (mode == Find) {
+        findEntries(group);
+        return Continue;
+    }
+    if (mode == ListKeys) {
+        if (!grp.exists)
+            return recursive ? Continue : Failed;
+        if (!grp.keyCount) {
+            if (!recursive && !gs_multiFile)
+                out() << "The group " << path(group) << " is empty\n";
+            return Continue;
+        }
+        const QString groupPath = out().isText() ? QString() : path(group);
+        const char *k = grp.keys;
+        for (int i = 0; i < grp.keyCount; ++i, k += qstrlen(k) + 2) { // skip the NUL and the next tag
+            const QString name = QString::fromUtf8(k);
+            if (key.isEmpty() || name.contains(key, Qt::CaseInsensitive))
+                out().name("key", groupPath, name);
+        }
+        return Continue;
+    }
+    // ListGroups
+    const int parent = grp.parent > -1 && m_groups.at(grp.parent).exists ? grp.parent : 0;
+    const QString parentPath = out().isText() ? QString() : path(parent);
+    for (int child = m_groups.at(parent).firstChild; child > -1; child = m_groups.at(child).next) {
+        const QString name = QString::fromUtf8(m_groups.at(child).name);
+        if (key.isEmpty() || name.contains(key, Qt::CaseInsensitive))
+            out().name("group", parentPath, name);
+    }
+    return Done;
+}
+
+/**
+ * A read-only view of a config cascade that maps the files and scans them in place, the way
+ * KConfigIniBackend parses them: later files override earlier ones unless the file, group or
+ * entry is immutable ([$i]), only the current locale is picked from localized entries.
+ * Keys and values point into the mapped files and are only unescaped once they get printed.
+ * Files with $e (expansion) or $d (deletion) markers are not supported, isValid() is false then
+ * and the caller has to use KConfig.
+ */
+class MappedConfig
+{
+public:
+    MappedConfig(const QString &name);
+    ~MappedConfig();
+    bool isValid() const { return m_valid; }
+    Status processGroup(const QByteArray &group, const QList<Pattern> &component, int next, Mode mode, const QString &key,
+                        bool recursive = false) const;
+    static QByteArray root() { return QByteArray("<default>"); }
+private:
+    struct Entry {
+        const char *value;
+        int length;
+        bool immutable;
+    };
+    struct Group {
+        Group() : immutable(false) {}
+        QHash<QByteArray, Entry> entries, localized;
+        bool immutable;
+    };
+    bool parse(const char *data, qint64 size);
+    Status process(const QByteArray &group, Mode mode, const QString &key, bool recursive) const;
+    // like KConfigGroup
+    bool exists(const QByteArray &group) const;
+    QByteArray child(const QByteArray &group, const QString &name) const;
+    QByteArray parent(const QByteArray &group) const;
+    QStringList groupList(const QByteArray &group) const; // null or root() for KConfig::groupList()
+    QStringList groupsNamed(const QByteArray &group, const QString &name) const;
+    QMap<QString, Entry> entryMap(const QByteArray &group) const;
+    QString path(QByteArray group) const;
+    static QByteArray unescape(const char *data, int length);
+    QString m_name;
+    QList<QPair<QFile*, uchar*> > m_maps; // every mapped file with its mapping
+    QHash<QByteArray, Group> m_groups; // subgroups are separated by \x1d, like in KConfig
+    QList<QByteArray> m_sortedGroups;
+    QMultiHash<QString, QByteArray> m_foldedPaths; // every group groupList() can list, case folded -> as it is spelled
+    QByteArray m_locale;
+    bool m_immutable;
+    bool m_valid;
+};
+
+MappedConfig::MappedConfig(const QString &name) : m_name(name), m_immutable(false), m_valid(false)
+{
+    StatsTimer timer(&Stats::parse);
+    m_locale = (KGlobal::hasLocale() ? KGlobal::locale()->language() : KLocale::defaultLanguage()).toUtf8();
+
+    // the order KConfig reads them: globals first (like KConfigPrivate::getGlobalFiles()), lowest priority first
+    QStringList globals, files;
+    const bool withGlobals = gs_layer == AllLayers && !gs_noGlobals;
+    if (withGlobals) {
+        if (QFile::exists("/etc/kderc"))
+            globals << "/etc/kderc";
+        foreach (const char *resource, QList<const char*>() << "system.kdeglobals" << "kdeglobals") {
+            const QStringList found = KGlobal::dirs()->findAllResources("config", resource);
+            for (int i = found.count() - 1; i > -1; --i)
+                globals << found.at(i);
+        }
+    }
+    if (name.startsWith('/')) {
+        files << name;
+    } else if (name != "kdeglobals" || !withGlobals) {
+        const QString local = KStandardDirs::locateLocal("config", name);
+        const QStringList cascade = KGlobal::dirs()->findAllResources("config", name);
+        for (int i = cascade.count() - 1; i > -1; --i) {
+            if (gs_layer == AllLayers || (gs_layer == UserLayer) == (cascade.at(i) == local))
+                files << cascade.at(i);
+        }
+    }
+
+    // an immutable file only ends its own part, like in KConfigPrivate::parseGlobalFiles() and parseConfigFiles()
+    foreach (const QStringList &part, QList<QStringList>() << globals << files) {
+        m_immutable = false;
+        foreach (const QString &path, part) {
+            QFile *file = new QFile(path);
+            if (!file->open(QIODevice::ReadOnly)) {
+                delete file;
+                continue;
+            }
+            COUNT(files);
+            const qint64 size = file->size();
+            uchar *data = size ? file->map(0, size) : 0;
+            if (data)
+                m_maps << qMakePair(file, data);
+            else
+                delete file;
+            if (!size)
+                continue;
+            if (!data)
+                return;
+            if (!parse(reinterpret_cast<const char*>(data), size))
+                return;
+            if (m_immutable)
+                break;
+        }
+    }
+
+    m_sortedGroups = m_groups.keys();
+    qSort(m_sortedGroups); // that's the order of the KConfig entry map
+    foreach (const QByteArray &name, m_sortedGroups) {
+        if (name.isEmpty() || name == root() || name == "$Version" || !exists(name))
+            continue;
+        for (int end = name.indexOf('\x1d'); ; end = name.indexOf('\x1d', end + 1)) {
+            const QByteArray path = end < 0 ? name : name.left(end);
+            const QString folded = QString::fromUtf8(path).toCaseFolded();
+            if (!m_foldedPaths.contains(folded, path))
+                m_foldedPaths.insert(folded, path);
+            if (end < 0)
+                break;
+        }
+    }
+    m_valid = true;
+}
+
+MappedConfig::~MappedConfig()
+{
+    for (int i = 0; i < m_maps.count(); ++i) {
+        m_maps.at(i).first->unmap(m_maps.at(i).second);
+        delete m_maps.at(i).first;
+    }
+}
+
+// like printableToString() in KConfigIniBackend
+QByteArray MappedConfig::unescape(const char *data, int length)
+{
+    if (!memchr(data, '\\', length))
+        return QByteArray::fromRawData(data, length);
+    QByteArray ret;
+    ret.reserve(length);
+    for (int i = 0; i < length; ++i) {
+        if (data[i] != '\\') {
+            ret += data[i];
+            continue;
+        }
+        if (++i == length) {
+            ret += '\\';
+            break;
+        }
+        switch (data[i]) {
+        case 's': ret += ' '; break;
+        case 't': ret += '\t'; break;
+        case 'n': ret += '\n'; break;
+        case 'r': ret += '\r'; break;
+        case '\\': ret += '\\'; break;
+        case 'x':
+            if (i + 2 < length) {
+                bool ok;
+                ret += char(QByteArray(data + i + 1, 2).toInt(&ok, 16));
+                i += 2;
+            } else {
+                ret += 'x';
+                i = length;
+            }
+            break;
+        default:
+            ret += '\\';
+            ret += data[i];
+        }
+    }
+    return ret;
+}
+
+bool MappedConfig::parse(const char *data, qint64 size)
+{
+    QByteArray currentGroup = root();
+    bool fileImmutable = false, groupImmutable = false, skipGroup = false;
+    QList<QByteArray> immutableGroups; // they become immutable once the whole file was read
+    const char *end = data + size;
+    for (const char *line = data, *next; line < end; line = next) {
+        const char *eol = static_cast<const char*>(memchr(line, '\n', end - line));
+        if (!eol)
+            eol = end;
+        next = eol + 1;
+        while (line < eol && isspace(uchar(*line)))
+            ++line;
+        while (eol > line && isspace(uchar(eol[-1])))
+            --eol;
+        const int length = eol - line;
+        if (!length || *line == '#')
+            continue;
+
+        if (*line == '[') {
+            QByteArray group;
+            groupImmutable = fileImmutable;
+            int start = 1, close;
+            bool valid = true;
+            do {
+                close = start;
+                while (close < length && line[close] != ']')
+                    ++close;
+                if (close == length) {
+                    valid = false; // KConfig ignores the line
+                    break;
+                }
+                if (close + 1 == length && close - start == 2 && line[start] == '$' && line[start + 1] == 'i') {
+                    if (group.isEmpty())
+                        fileImmutable = true;
+                    else
+                        groupImmutable = true;
+                } else {
+                    if (!group.isEmpty())
+                        group += '\x1d';
+                    group += unescape(line + start, close - start);
+                }
+            } while ((start = close + 2) <= length && line[close + 1] == '[');
+            if (!valid)
+                continue;
+            currentGroup = group;
+            skipGroup = m_groups.value(currentGroup).immutable;
+            if (groupImmutable && !skipGroup)
+                immutableGroups << currentGroup;
+            continue;
+        }
+
+        if (skipGroup)
+            continue;
+        const char *eq = static_cast<const char*>(memchr(line, '=', length));
+        if (!eq)
+            continue;
+        const char *keyEnd = eq, *value = eq + 1;
+        while (keyEnd > line && isspace(uchar(keyEnd[-1])))
+            --keyEnd;
+        while (value < eol && isspace(uchar(*value)))
+            ++value;
+
+        // key[locale][$flags], the options can come in any order
+        const char *options = static_cast<const char*>(memchr(line, '[', keyEnd - line));
+        const char *keyNameEnd = options ? options : keyEnd;
+        bool entryImmutable = groupImmutable, valid = true;
+        QByteArray locale;
+        while (options && options < keyEnd) {
+            const char *close = static_cast<const char*>(memchr(options, ']', keyEnd - options));
+            if (*options != '[' || !close) {
+                valid = false;
+                break;
+            }
+            if (options[1] == '$') {
+                for (const char *flag = options + 2; flag < close; ++flag) {
+                    if (*flag == 'i')
+                        entryImmutable = true;
+                    else
+                        return false; // $e, $d, $a - leave that to KConfig
+                }
+            } else {
+                locale = QByteArray(options + 1, close - options - 1);
+            }
+            options = close + 1;
+        }
+        while (keyNameEnd > line && isspace(uchar(keyNameEnd[-1])))
+            --keyNameEnd;
+        if (!valid || keyNameEnd == line)
+            continue;
+        if (!locale.isNull() && locale != m_locale && (locale.at(0) != 'C' || m_locale != "en_US"))
+            continue;
+
+        Group &group = m_groups[currentGroup];
+        QHash<QByteArray, Entry> &entries = locale.isNull() ? group.entries : group.localized;
+        const QByteArray key = unescape(line, keyNameEnd - line);
+        QHash<QByteArray, Entry>::iterator it = entries.find(key);
+        if (it != entries.end() && it->immutable)
+            continue;
+        const Entry entry = { value, int(eol - value), entryImmutable };
+        entries.insert(key, entry);
+    }
+    foreach (const QByteArray &group, immutableGroups)
+        m_groups[group].immutable = true;
+    m_immutable = fileImmutable;
+    return true;
+}
+
+// a group exists as soon as it has an entry, not because of its header
+bool MappedConfig::exists(const QByteArray &group) const
+{
+    const QHash<QByteArray, Group>::const_iterator it = m_groups.constFind(group);
+    return it != m_groups.constEnd() && !(it->entries.isEmpty() && it->localized.isEmpty());
+}
+
+QByteArray MappedConfig::child(const QByteArray &group, const QString &name) const
+{
+    return group == root() ? name.toUtf8() : group + '\x1d' + name.toUtf8();
+}
+
+QByteArray MappedConfig::parent(const QByteArray &group) const
+{
+    const int separator = group.lastIndexOf('\x1d');
+    return separator < 0 ? root() : group.left(separator);
+}
+
+QStringList MappedConfig::groupList(const QByteArray &group) const
+{
+    QSet<QString> groups; // KConfig collects them in a set as well, so the order is the same
+    if (group.isNull() || group == root()) {
+        foreach (const QByteArray &name, m_sortedGroups) {
+            if (!name.isEmpty() && name != root() && name != "$Version" && exists(name))
+                groups << QString::fromUtf8(name).section(QChar('\x1d'), 0, 0);
+        }
+    } else {
+        const QByteArray prefix = group + '\x1d';
+        foreach (const QByteArray &name, m_sortedGroups) {
+            if (name.startsWith(prefix) && exists(name))
+                groups << QString::fromUtf8(name.mid(prefix.length())).section(QChar('\x1d'), 0, 0);
+        }
+    }
+    return groups.toList();
+}
+
+// the names groupList() has that are name in any case, without going through all groups
+QStringList MappedConfig::groupsNamed(const QByteArray &group, const QString &name) const
+{
+    const QByteArray prefix = group.isNull() || group == root() ? QByteArray() : group + '\x1d';
+    QStringList names;
+    foreach (const QByteArray &path, m_foldedPaths.values(QString::fromUtf8(prefix + name.toUtf8()).toCaseFolded())) {
+        if (path.startsWith(prefix))
+            names << QString::fromUtf8(path.mid(prefix.length()));
+    }
+    return names;
+}
+
+QMap<QString, MappedConfig::Entry> MappedConfig::entryMap(const QByteArray &group) const
+{
+    QMap<QString, Entry> map;
+    const QHash<QByteArray, Group>::const_iterator it = m_groups.constFind(group);
+    if (it == m_groups.constEnd())
+        return map;
+    // the localized entry wins
+    for (QHash<QByteArray, Entry>::const_iterator entry = it->localized.constBegin(); entry != it->localized.constEnd(); ++entry)
+        map.insert(QString::fromUtf8(entry.key()), entry.value());
+    for (QHash<QByteArray, Entry>::const_iterator entry = it->entries.constBegin(); entry != it->entries.constEnd(); ++entry) {
+        const QString key = QString::fromUtf8(entry.key());
+        if (!map.contains(key))
+            map.insert(key, entry.value());
+    }
+    return map;
+}
+
+// like path(KConfigGroup)
+QString MappedConfig::path(QByteArray group) const
+{
+    QString ret;
+    for (; group != root() && exists(group); group = parent(group))
+        ret.prepend("/" + QString::fromUtf8(group.mid(group.lastIndexOf('\x1d') + 1)));
+    ret.prepend(m_name);
+    return ret;
+}
+
+#define VALUE(_E_) QString::fromUtf8(unescape(_E_.value, _E_.length))
+
+// mirrors ::processGroup()
+Status MappedConfig::processGroup(const QByteArray &group, const QList<Pattern> &component, int next, Mode mode, const QString &key,
+                                  bool recursive) const
+{
+    COUNT(groups);
+    if (next == component.count())
+        return process(group, mode, key, recursive);
+
+    const Pattern &groupMatch = component.at(next);
+    if (groupMatch.type() == Pattern::Recursive) {
+        Status status = next + 1 < component.count() || exists(group) ?
+                        processGroup(group, component, next + 1, mode, key, true) : Continue;
+        foreach (const QString &g, groupList(group)) {
+            if (status != Continue)
+                break;
+            status = processGroup(child(group, g), component, next, mode, key, true);
+        }
+        return status;
+    }
+    const QByteArray listed = exists(group) || recursive ? group : QByteArray();
+    const QStringList groups = groupMatch.type() == Pattern::Literal ? groupsNamed(listed, groupMatch.literal()) : groupList(listed);
+    int hits = 0;
+    foreach (const QString &g, groups) {
+        if (groupMatch.matches(g)) {
+            ++hits;
+            const Status status = processGroup(child(group, g), component, next + 1, mode, key, recursive);
+            if (status != Continue)
+                return status;
+        }
+    }
+    if (!hits && !recursive && !gs_multiFile) {
+        out() << "No existing group matches " << groupMatch.pattern() << "\n";
+    }
+    return Continue;
+}
+
+// mirrors ::process() for the read-only modes
+Status MappedConfig::process(const QByteArray &group, Mode mode, const QString &key, bool recursive) const
+{
+    switch (mode) {
+    case Read: {
+        const QMap<QString, Entry> map = entryMap(group);
+        const QMap<QString, Entry>::const_iterator it = map.constFind(key);
+        const bool found = it != map.constEnd();
+        if (!out().isText()) {
+            if (found)
+                out().entry(path(group), key, VALUE((*it)));
+        } else if (gs_tty || gs_printPath) {
+            out() << key << ": " << (found ? VALUE((*it)) : QString("does not exist")) << " (" << path(group) << ")\n";
+        } else {
+            out() << (found ? VALUE((*it)) : QString(""));
+            if (gs_batch)
+                out() << "\n";
+        }
+        break;
+    }
+    case List:
+    case ListKeys: {
+        if (!exists(group) && recursive) // the ** lists its subgroups on its own
+            break;
+        if (!exists(group)) { // could be parent group
+            if (mode == ListKeys)
+                return Failed;
+            const QByteArray up = parent(group);
+            QStringList groups = groupList(exists(up) ? up : QByteArray());
+            if (groups.isEmpty()) {
+                out().error(path(group), "The component/group " + path(group) + " does not exist");
+                return Failed;
+            }
+            const QString groupPath = path(group);
+            out() << "Groups in " << groupPath << gs_separator << "\n";
+            foreach (const QString &s, groups)
+                if (key.isEmpty() || s.contains(key, Qt::CaseInsensitive))
+                    out().name("group", groupPath, s);
+            return Done;
+        }
+
+        const bool quiet = recursive || gs_multiFile;
+        const QMap<QString, Entry> map = entryMap(group);
+        if (map.isEmpty()) {
+            if (!quiet)
+                out() << "The group " << path(group) << " is empty\n";
+            break;
+        }
+
+        const QString groupPath = path(group);
+        if (mode == List) {
+            bool matchFound = false;
+            for (QMap<QString, Entry>::const_iterator it = map.constBegin(), end = map.constEnd(); it != end; ++it) {
+                if (key.isEmpty() || it.key().contains(key, Qt::CaseInsensitive)) {
+                    if (!matchFound)
+                        out() << "\n" << groupPath << gs_separator << "\n";
+                    matchFound = true;
+                    out().entry(groupPath, it.key(), VALUE(it.value()));
+                }
+            }
+
+            if (!matchFound && !quiet)
+                out() << "No present key matches \"" << key << "\" in " << groupPath;
+            if (matchFound || !quiet)
+                out() << "\n";
+        } else {
+            for (QMap<QString, Entry>::const_iterator it = map.constBegin(), end = map.constEnd(); it != end; ++it) {
+                if (key.isEmpty() || it.key().contains(key, Qt::CaseInsensitive)) {
+                    out().name("key", groupPath, it.key());
+                }
+            }
+        }
+        break;
+    }
+    case ListGroups: {
+        const QByteArray up = parent(group);
+        QStringList groups = groupList(exists(up) ? up : QByteArray());
+        const QString parentPath = out().isText() ? QString() : path(up);
+        foreach (const QString &s, groups)
+            if (key.isEmpty() || s.contains(key, Qt::CaseInsensitive))
+                out().name("group", parentPath, s);
+        return Done;
+    }
+    default:
+        break;
+    }
+    return Continue;
+}
+
+#undef VALUE
+
+// the file names in all config dirs, cached in an index that is stale once any of the dirs changed
+int listComponents(const QString &filter)
+{
+    const QStringList dirs = KGlobal::dirs()->resourceDirs("config");
+    QStringList names;
+    QFile index(indexPath("components"));
+    if (index.open(QIODevice::ReadOnly) && index.size() > 6) {
+        const qint64 size = index.size();
+        uchar *mapped = index.map(0, size);
+        const char *data = reinterpret_cast<const char*>(mapped);
+        if (data && !memcmp(data, "KCIX1", 6) && data[size - 1] == '\0') {
+            int checked = 0;
+            bool valid = true;
+            for (const char *record = data + 6, *end = data + size; valid && record < end; record += qstrlen(record) + 1) {
+                if (*record == 'C') {
+                    names << QString::fromUtf8(record + 1);
+                } else {
+                    QString path;
+                    FileStamp stamp;
+                    valid = *record == 'F' && checked < dirs.count() && parseStampRecord(record + 1, path, stamp) &&
+                            path == dirs.at(checked) && stamp == fileStamp(path);
+                    ++checked;
+                }
+            }
+            if (!valid || checked != dirs.count())
+                names.clear();
+        }
+        if (mapped)
+            index.unmap(mapped);
+    }
+    if (names.isEmpty()) {
+        QByteArray data("KCIX1", 6);
+        foreach (const QString &dir, dirs) {
+            appendRecord(data, 'F', stampRecord(dir, fileStamp(dir)));
+            names << QDir(dir).entryList(QDir::Files);
+        }
+        names.sort();
+        names.removeDuplicates();
+        foreach (const QString &name, names)
+            appendRecord(data, 'C', name.toUtf8());
+        saveFile(index.fileName(), data);
+    }
+    foreach (const QString &name, names) {
+        if (filter.isEmpty() || name.contains(filter, Qt::CaseInsensitive))
+            out().name("component", QString(), name);
+    }
+    return 0;
+}
+
+// splits the component argument into the file and the group path, returns the index of the first group
+int resolveComponent(QString &file, QStringList &component)
+{
+    component = file.split('/', QString::SkipEmptyParts);
+    if (component.isEmpty())
+        return 0;
+    int firstGroupIndex = 1;
+    if (file.startsWith('/')) {
+        file = '/' + component.at(firstGroupIndex - 1);
+        while (firstGroupIndex < component.count() && QFile::exists(file + '/' + component.at(firstGroupIndex)))
+            file += '/' + component.at(firstGroupIndex++);
+    } else {
+        file = component.at(0);
+    }
+    return firstGroupIndex;
+}
+
+/**
+ * Writers of the same file are serialized by an flock() on a lock file per config, held from parsing
+ * until sync() (which merges the changes into the file as it is on disk then and replaces it).
+ * Writers of different files don't wait for each other.
+ */
+static QHash<QString, int> gs_locks; // file -> descriptor of the lock file
+static QMutex gs_locksMutex; // multi file queries lock from their workers
+
+// the file the lock is for, the same for a component and its path
+static QString lockTarget(const QString &file)
+{
+    return file.startsWith('/') ? file : KStandardDirs::locateLocal("config", file);
+}
+
+// 1 if the lock was taken, 0 if this process holds it already, -1 on errors
+int lockConfig(const QString &file)
+{
+#ifdef Q_OS_WIN32
+    Q_UNUSED(file);
+    return 0;
+#else
+    const QString target = lockTarget(file);
+    {
+        QMutexLocker locker(&gs_locksMutex);
+        if (gs_locks.contains(target))
+            return 0;
+    }
+    QString name = target;
+    name.replace('/', '%');
+    const QString path = KStandardDirs::locateLocal("tmp", "kconfig-locks/" + name);
+    const int fd = ::open(QFile::encodeName(path).constData(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    while (flock(fd, LOCK_EX) < 0) {
+        if (errno != EINTR) {
+            ::close(fd);
+            return -1;
+        }
+    }
+    QMutexLocker locker(&gs_locksMutex);
+    gs_locks.insert(target, fd);
+    return 1;
+#endif
+}
+
+void unlockConfig(const QString &file)
+{
+#ifndef Q_OS_WIN32
+    const QString target = lockTarget(file);
+    QMutexLocker locker(&gs_locksMutex);
+    const QHash<QString, int>::iterator it = gs_locks.find(target);
+    if (it != gs_locks.end()) {
+        ::close(it.value()); // releases the flock
+        gs_locks.erase(it);
+    }
+#else
+    Q_UNUSED(file);
+#endif
+}
+
+/**
+ * Locks files in the order of their lock files, whoever needs several of them takes them in the same order
+ * and nobody waits for a file that is held by someone waiting for one of his. The files this call locked
+ * are appended to locked, on errors it unlocks them again.
+ */
+bool lockConfigs(const QStringList &files, QStringList &locked)
+{
+    QMap<QString, QString> ordered; // lock target -> file
+    foreach (const QString &file, files)
+        ordered.insert(lockTarget(file), file);
+    const int count = locked.count();
+    foreach (const QString &file, ordered) {
+        const int result = lockConfig(file);
+        if (result < 0) {
+            out().error(QString(), "Cannot lock " + file);
+            while (locked.count() > count)
+                unlockConfig(locked.takeLast());
+            return false;
+        }
+        if (result > 0)
+            locked << file;
+    }
+    return true;
+}
+
+// the full name of a group header line ("[a][b]" -> "a\x1db"), immutable is set for a [$i] marker
+static QByteArray groupHeader(const QByteArray &line, bool *immutable)
+{
+    QByteArray group;
+    *immutable = false;
+    for (int start = 1, close; start < line.length(); start = close + 2) {
+        if ((close = line.indexOf(']', start)) < 0)
+            break;
+        const QByteArray name = line.mid(start, close - start);
+        if (name == "$i") {
+            *immutable = true;
+        } else {
+            if (!group.isEmpty())
+                group += '\x1d';
+            group += name;
+        }
+        if (close + 1 >= line.length() || line.at(close + 1) != '[')
+            break;
+    }
+    return group;
+}
+
+/**
+ * The entries of an rc file as they are written, with the locale and flags still in the key and the value
+ * not unescaped. Later files override the entries of earlier ones.
+ */
+typedef QHash<QByteArray, QHash<QByteArray, QByteArray> > RawEntries; // group -> key -> value
+
+static void readRawEntries(const QString &path, RawEntries &entries)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+    QByteArray group("<default>");
+    bool immutable;
+    foreach (QByteArray line, file.readAll().split('\n')) {
+        line = line.trimmed();
+        if (line.isEmpty() || line.at(0) == '#')
+            continue;
+        if (line.at(0) == '[') {
+            group = groupHeader(line, &immutable);
+            continue;
+        }
+        const int eq = line.indexOf('=');
+        if (eq > 0)
+            entries[group].insert(line.left(eq).trimmed(), line.mid(eq + 1).trimmed());
+    }
+}
+
+// a kept group header goes after a blank line
+static void appendHeader(QByteArray &result, const QByteArray &header)
+{
+    if (!result.isEmpty() && !result.endsWith("\n\n"))
+        result += '\n';
+    result += header;
+}
+
+/**
+ * Drops the entries of the user's file that have the same value in the rest of the cascade (the system wide
+ * files and the globals) and the groups that end up empty. Works on the text of the file, so entries with
+ * flags, comments and the order of everything stay as they are.
+ */
+Status compact(const QString &file, bool dryRun)
+{
+    if (file.startsWith('/')) {
+        out().error(file, "compact needs a component, " + file + " has no cascade");
+        return Failed;
+    }
+    const QString local = KStandardDirs::locateLocal("config", file);
+    if (!QFile::exists(local)) {
+        if (!gs_multiFile)
+            out() << "There is no user file for " << file << "\n";
+        return Continue;
+    }
+
+    // what the values would be without the user's file, lowest priority first like KConfig reads them
+    QStringList lower;
+    if (!gs_noGlobals)
+        lower << "/etc/kderc";
+    QStringList globals;
+    if (!gs_noGlobals)
+        globals = KGlobal::dirs()->findAllResources("config", "kdeglobals");
+    if (file == "kdeglobals")
+        globals.removeAll(local);
+    for (int i = globals.count() - 1; i > -1; --i)
+        lower << globals.at(i);
+    if (file != "kdeglobals") {
+        const QStringList cascade = KGlobal::dirs()->findAllResources("config", file);
+        for (int i = cascade.count() - 1; i > -1; --i) {
+            if (cascade.at(i) != local)
+                lower << cascade.at(i);
+        }
+    }
+    RawEntries defaults;
+    foreach (const QString &path, lower)
+        readRawEntries(path, defaults);
+
+    const int locked = dryRun ? 0 : lockConfig(file);
+    if (locked < 0) {
+        out().error(local, "Cannot lock " + local);
+        return Failed;
+    }
+    // the lock KConfig::sync takes, held until the new file is in place
+    KLockFile syncLock(local + ".lock");
+    if (!dryRun) {
+        if (syncLock.lock() == KLockFile::LockStale)
+            syncLock.lock(KLockFile::ForceFlag);
+        if (!syncLock.isLocked()) {
+            out().error(local, "Cannot lock " + local + ".lock");
+            if (locked > 0)
+                unlockConfig(file);
+            return Failed;
+        }
+    }
+    QFile in(local);
+    if (!in.open(QIODevice::ReadOnly)) {
+        out().error(local, "Cannot read " + local);
+        if (locked > 0)
+            unlockConfig(file);
+        return Failed;
+    }
+    const QByteArray data = in.readAll();
+    in.close();
+
+    // the lines that stay, a group header is only kept once one of its entries is,
+    // or if the group had no entries to begin with
+    QByteArray result, pendingHeader;
+    QByteArray group("<default>");
+    bool immutable = false, fileImmutable = false, dropped = false;
+    int entries = 0, groups = 0;
+    QString groupPath = file;
+    foreach (const QByteArray &rawLine, data.split('\n')) {
+        const QByteArray line = rawLine.trimmed();
+        if (!line.isEmpty() && line.at(0) == '[') {
+            if (!pendingHeader.isNull()) {
+                if (dropped)
+                    ++groups;
+                else
+                    appendHeader(result, pendingHeader);
+            }
+            dropped = false;
+            group = groupHeader(line, &immutable);
+            if (group.isEmpty()) { // the [$i] of the whole file, nothing can be overridden
+                fileImmutable = true;
+                pendingHeader = QByteArray();
+                result += rawLine + '\n';
+                continue;
+            }
+            pendingHeader = rawLine + '\n';
+            groupPath = file + '/' + QString::fromUtf8(group).replace('\x1d', '/');
+            continue;
+        }
+        const int eq = line.indexOf('=');
+        if (!line.isEmpty() && line.at(0) != '#' && eq > 0 && !immutable && !fileImmutable) {
+            const QByteArray key = line.left(eq).trimmed();
+            const QHash<QByteArray, QByteArray> &defaultGroup = defaults[group];
+            const QHash<QByteArray, QByteArray>::const_iterator it = defaultGroup.constFind(key);
+            if (it != defaultGroup.constEnd() && it.value() == line.mid(eq + 1).trimmed()) {
+                ++entries;
+                dropped = true;
+                out().record("redundant", groupPath, QString::fromUtf8(key), QString::fromUtf8(it.value()));
+                continue;
+            }
+        }
+        if (line.isEmpty() && !pendingHeader.isNull())
+            continue; // blank lines of a group that might vanish
+        if (!pendingHeader.isNull()) {
+            appendHeader(result, pendingHeader);
+            pendingHeader = QByteArray();
+        }
+        if (!line.isEmpty() || !result.endsWith("\n\n"))
+            result += rawLine + '\n';
+    }
+    if (!pendingHeader.isNull()) {
+        if (dropped)
+            ++groups;
+        else
+            appendHeader(result, pendingHeader);
+    }
+    while (result.endsWith("\n\n"))
+        result.chop(1);
+    if (!data.endsWith('\n') && result.endsWith('\n'))
+        result.chop(1);
+
+    const int saved = data.size() - result.size();
+    if (entries || groups || !gs_multiFile) {
+        out() << (dryRun ? "Would remove " : "Removed ") << QString::number(entries) << " entries and "
+              << QString::number(groups) << " empty groups from " << local << ", " << QString::number(saved) << " bytes\n";
+    }
+    out().record(dryRun ? "wouldcompact" : "compacted", local, QString::number(entries), QString::number(saved));
+    Status status = Continue;
+    if (!dryRun) {
+        if ((entries || groups) && !saveFile(local, result)) {
+            out().error(local, "Cannot write " + local);
+            status = Failed;
+        }
+    }
+    syncLock.unlock();
+    if (locked > 0)
+        unlockConfig(file);
+    return status;
+}
+
+// args are <component> <command> [<key>] [<value>] [<new value>], the configs are kept open for the caller to sync
+Status execute(const QStringList &args, QHash<QString, KConfig*> &configs)
+{
+    const Mode mode = checkMode(args.at(1), args.count() + 1);
+    if (mode == Invalid)
+        return Failed;
+
+    QString file = args.at(0);
+    QStringList component;
+    const int firstGroupIndex = resolveComponent(file, component);
+    if (component.isEmpty()) {
+        out().error(QString(), "Invalid component: " + args.at(0));
+        return Failed;
+    }
+    const QList<Pattern> groups = patterns(component.mid(firstGroupIndex));
+    if (gs_layer == SystemLayer && mode != Read && mode != List && mode != ListKeys && mode != ListGroups && mode != Find && mode != Watch) {
+        out().error(QString(), "The system layer is read-only");
+        return Failed;
+    }
+    if (mode == Compact) {
+        if (!groups.isEmpty()) {
+            out().error(QString(), "compact works on whole components, not on groups");
+            return Failed;
+        }
+        if (!args.value(2).isEmpty() && args.value(2) != "--dry-run") {
+            out().error(QString(), "Unknown option: " + args.value(2));
+            return Failed;
+        }
+        if (gs_batch) {
+            gs_compacts << qMakePair(file, args.value(2) == "--dry-run");
+            return Continue;
+        }
+        return compact(file, args.value(2) == "--dry-run");
+    }
+    // the index covers the whole cascade, --show-layer needs the KConfig of every file
+    const bool useIndex = gs_useIndex && gs_layer == AllLayers && !gs_noGlobals && !gs_showLayer;
+    const bool completion = mode == ListKeys || mode == ListGroups;
+    if (completion && useIndex && !gs_batch && !configs.contains(file)) {
+        const CompletionIndex index(file);
+        if (index.isValid())
+            return index.processGroup(0, groups, 0, mode, args.value(2));
+        if (!gs_mapped) {
+            KConfig *cfg = openConfig(file);
+            configs.insert(file, cfg);
+            if (!gs_multiFile) // the workers of runGlob() only read indexes, see there
+                CompletionIndex::write(file, index.stamps(), *cfg);
+        }
+    }
+    if (mode == Find && useIndex && !gs_batch && !configs.contains(file)) {
+        // the values come from KConfig, which is only parsed once the index has a matching key name
+        CompletionIndex index(file);
+        if (index.isValid()) {
+            KConfig *cfg = 0;
+            const Status status = index.find(groups, args.value(2), args.value(3), cfg);
+            if (cfg)
+                configs.insert(file, cfg);
+            return status;
+        }
+        KConfig *cfg = openConfig(file);
+        configs.insert(file, cfg);
+        if (!gs_multiFile)
+            CompletionIndex::write(file, index.stamps(), *cfg);
+    }
+    if ((completion || mode == Read || mode == List) && gs_mapped && !gs_showLayer && !gs_batch && !configs.contains(file)) {
+        const MappedConfig cfg(file);
+        if (cfg.isValid())
+            return cfg.processGroup(MappedConfig::root(), groups, 0, mode, args.value(2));
+    }
+    // writers lock the file before they parse it, so nothing written meanwhile gets lost
+    const bool writing = mode == Write || mode == Delete || mode == DeleteGroup || mode == Replace ||
+                         mode == Cas || mode == Incr || mode == SetDefault ||
+                         mode == CopyGroup || mode == MoveGroup || mode == RenameGroup;
+    QStringList lockFiles;
+    if (writing)
+        lockFiles << file;
+
+    // copygroup and movegroup write into the group <key>, which can be in another component
+    CopyTarget target;
+    if (mode == CopyGroup || mode == MoveGroup) {
+        QString targetFile = args.at(2);
+        QStringList targetComponent;
+        const int firstTargetGroup = resolveComponent(targetFile, targetComponent);
+        target.groups = targetComponent.mid(firstTargetGroup);
+        if (target.groups.isEmpty()) {
+            out().error(QString(), "The target must be a group: " + args.at(2));
+            return Failed;
+        }
+        if (targetFile != file)
+            lockFiles << targetFile;
+        target.file = targetFile;
+    }
+
+    QStringList locked;
+    if (!lockConfigs(lockFiles, locked))
+        return Failed;
+    foreach (const QString &f, locked) {
+        if (configs.value(f)) // parsed before we had the lock
+            configs.value(f)->reparseConfiguration();
+    }
+    foreach (const QString &f, QStringList() << file << target.file) {
+        if (!f.isNull() && !configs.value(f))
+            configs.insert(f, openConfig(f));
+    }
+    KConfig *cfg = configs.value(file);
+    target.config = target.file.isNull() ? 0 : configs.value(target.file);
+    gs_copyTarget = &target;
+    const Status status = processGroup(cfg->group(QString()), groups, mode, args.value(2), args.value(3), args.value(4));
+    gs_copyTarget = 0;
+    if (!gs_batch) { // the batch syncs at the end
+        foreach (const QString &f, locked)
+            unlockConfig(f);
+    }
+    return status;
+}
+
+// prints one difference found by watch or diff, the text lines don't carry the group so it gets a header
+void printChange(QString &lastPath, const QString &path, const QString &key, const QString *oldValue, const QString *value)
+{
+    if (out().isText() && path != lastPath) {
+        lastPath = path;
+        out() << "\n" << path << gs_separator << "\n";
+    }
+    if (!oldValue)
+        out().added(path, key, *value);
+    else if (!value)
+        out().removed(path, key, *oldValue);
+    else
+        out().changed(path, key, *oldValue, QString(), *value);
+}
+
+#ifdef Q_OS_LINUX
+// collects the entries the watch command looks at from a freshly parsed config
+EntryState watchedState(const QString &file, const QList<Pattern> &groups, const QString &key)
+{
+    EntryState state;
+    gs_watched = &state;
+    KConfig *cfg = openConfig(file);
+    processGroup(cfg->group(QString()), groups, Watch, key, QString());
+    delete cfg;
+    gs_watched = 0;
+    return state;
+}
+
+int watch(const QStringList &args)
+{
+    QString file = args.at(0);
+    QStringList component;
+    const int firstGroupIndex = resolveComponent(file, component);
+    if (component.isEmpty()) {
+        out().error(QString(), "Invalid component: " + args.at(0));
+        return 1;
+    }
+    const QList<Pattern> groups = patterns(component.mid(firstGroupIndex));
+    const QString key = args.value(2);
+
+    // the directories are watched, KSaveFile and most editors replace the file instead of writing to it
+    const int fd = inotify_init();
+    if (fd < 0) {
+        out().error(QString(), QString("Cannot watch: ") + strerror(errno));
+        return 1;
+    }
+    QHash<int, QStringList> watchedFiles; // watch descriptor -> file names in that directory
+    foreach (const QString &path, cascade(file)) {
+        const int slash = path.lastIndexOf('/');
+        const int wd = inotify_add_watch(fd, QFile::encodeName(path.left(slash)).constData(),
+                                         IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+        if (wd > -1)
+            watchedFiles[wd] << path.mid(slash + 1);
+    }
+    if (watchedFiles.isEmpty()) {
+        out().error(QString(), "None of the directories of " + file + " can be watched");
+        ::close(fd);
+        return 1;
+    }
+
+    EntryState state = watchedState(file, groups, key);
+    out().flush();
+    gs_multiFile = true; // the groups might show up later, don't complain on every change
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    forever {
+        bool relevant = false;
+        pollfd pfd = { fd, POLLIN, 0 };
+        // block for the first event, then collect what follows within 50ms so a burst of writes is one update
+        for (int timeout = -1; poll(&pfd, 1, timeout) > 0; timeout = relevant ? 50 : -1) {
+            const ssize_t length = read(fd, buffer, sizeof(buffer));
+            if (length < 1)
+                break;
+            for (const char *ptr = buffer; ptr < buffer + length; ) {
+                const inotify_event *event = reinterpret_cast<const inotify_event*>(ptr);
+                if (event->len && watchedFiles.value(event->wd).contains(QFile::decodeName(event->name)))
+                    relevant = true;
+                ptr += sizeof(inotify_event) + event->len;
+            }
+        }
+        if (!relevant) {
+            if (pfd.revents & (POLLERR | POLLHUP))
+                break;
+            continue;
+        }
+
+        // both maps are sorted, walk them in parallel
+        const EntryState current = watchedState(file, groups, key);
+        EntryState::const_iterator old = state.constBegin(), now = current.constBegin();
+        QString lastPath;
+        while (old != state.constEnd() || now != current.constEnd()) {
+            if (now == current.constEnd() || (old != state.constEnd() && old.key() < now.key())) {
+                printChange(lastPath, old.key().first, old.key().second, &old.value(), 0);
+                ++old;
+            } else if (old == state.constEnd() || now.key() < old.key()) {
+                printChange(lastPath, now.key().first, now.key().second, 0, &now.value());
+                ++now;
+            } else {
+                if (old.value() != now.value())
+                    printChange(lastPath, now.key().first, now.key().second, &old.value(), &now.value());
+                ++old;
+                ++now;
+            }
+        }
+        out().flush();
+        state = current;
+    }
+    ::close(fd);
+    return 1;
+}
+#endif
+
+/**
+ * Snapshots are the entries of whole configs in one sorted stream:
+ * "KCSN1\n", then for every group with entries 'G' <path>, followed by 'E' <key> <value> for its entries.
+ * Strings are UTF-8, prefixed by their length as LEB128, groups and keys are sorted bytewise
+ * so diff can merge-walk two snapshots without parsing them into maps.
+ */
+static const char gs_snapshotMagic[] = "KCSN1\n";
+
+static bool lessBytes(const QByteArray &a, const QByteArray &b)
+{
+    const int cmp = memcmp(a.constData(), b.constData(), qMin(a.size(), b.size()));
+    return cmp < 0 || (!cmp && a.size() < b.size());
+}
+
+static void appendString(std::string &data, const QByteArray &string)
+{
+    for (quint32 length = string.size(); ; length >>= 7) {
+        if (length < 0x80) {
+            data += char(length);
+            break;
+        }
+        data += char((length & 0x7f) | 0x80);
+    }
+    data.append(string.constData(), string.size());
+}
+
+typedef QPair<QByteArray, std::string> SnapshotGroup; // path and its encoded entries
+
+// the group tree below grp, with paths formatted like path()
+static void snapshotGroup(const KConfigGroup &grp, const QByteArray &groupPath, QList<SnapshotGroup> &groups)
+{
+    const QMap<QString, QString> map = grp.entryMap();
+    if (!map.isEmpty()) {
+        QList<QByteArray> keys;
+        for (QMap<QString, QString>::const_iterator it = map.constBegin(), end = map.constEnd(); it != end; ++it)
+            keys << it.key().toUtf8();
+        qSort(keys.begin(), keys.end(), lessBytes);
+        std::string data;
+        foreach (const QByteArray &key, keys) {
+            data += 'E';
+            appendString(data, key);
+            appendString(data, map.value(QString::fromUtf8(key)).toUtf8());
+        }
+        groups << qMakePair(groupPath, data);
+    }
+    foreach (const QString &name, grp.groupList())
+        snapshotGroup(grp.group(name), groupPath + '/' + name.toUtf8(), groups);
+}
+
+static bool lessGroup(const SnapshotGroup &a, const SnapshotGroup &b)
+{
+    return lessBytes(a.first, b.first);
+}
+
+int snapshot(const QString &source)
+{
+    // a directory contributes its files as they are, a component is read with its whole cascade
+    QList<QPair<QByteArray, QString> > configs; // name in the snapshot, file for KConfig
+    const QFileInfo info(source);
+    if (info.isDir()) {
+        foreach (const QString &name, QDir(source).entryList(QDir::Files))
+            configs << qMakePair(name.toUtf8(), info.absoluteFilePath() + '/' + name);
+    } else {
+        QString file = source;
+        QStringList component;
+        resolveComponent(file, component);
+        if (component.isEmpty()) {
+            out().error(QString(), "Invalid component: " + source);
+            return 1;
+        }
+        configs << qMakePair(file.toUtf8(), file);
+    }
+
+    if (!out().isText()) {
+        out().error(source, "Snapshots have their own format, --format does not apply");
+        return 1;
+    }
+    QList<SnapshotGroup> groups;
+    for (int i = 0; i < configs.count(); ++i) {
+        KConfig *cfg = openConfig(configs.at(i).second, info.isDir() ? KConfig::SimpleConfig : KConfig::FullConfig);
+        snapshotGroup(cfg->group(QString()), configs.at(i).first, groups);
+        delete cfg;
+    }
+    // sorted by the whole path, "a/b" comes after "a b" although b is a child of a
+    qSort(groups.begin(), groups.end(), lessGroup);
+
+    std::string data(gs_snapshotMagic);
+    foreach (const SnapshotGroup &group, groups) {
+        data += 'G';
+        appendString(data, group.first);
+        data += group.second;
+        if (data.size() > 1 << 16) {
+            out().write(data.data(), data.size());
+            data.clear();
+        }
+    }
+    out().write(data.data(), data.size());
+    return 0;
+}
+
+// reads a snapshot from its mapping
+class SnapshotReader
+{
+public:
+    SnapshotReader(const char *data, qint64 size) : m_pos(data), m_end(data + size), m_valid(true), m_type(0) { next(); }
+    bool atEnd() const { return !m_type; }
+    bool isValid() const { return m_valid; }
+    char type() const { return m_type; }
+    const QByteArray &key() const { return m_key; } // the path of a 'G' record
+    const QByteArray &value() const { return m_value; }
+    void next();
+private:
+    bool readString(QByteArray &string);
+    const char *m_pos, *m_end;
+    bool m_valid;
+    char m_type;
+    QByteArray m_key, m_value;
+};
+
+bool SnapshotReader::readString(QByteArray &string)
+{
+    quint32 length = 0;
+    for (int shift = 0; ; shift += 7) {
+        if (m_pos == m_end || shift > 28)
+            return false;
+        const uchar c = *m_pos++;
+        length |= quint32(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            break;
+    }
+    if (length > quint32(m_end - m_pos))
+        return false;
+    string = QByteArray::fromRawData(m_pos, length);
+    m_pos += length;
+    return true;
+}
+
+void SnapshotReader::next()
+{
+    m_type = 0;
+    if (!m_valid || m_pos == m_end)
+        return;
+    const char type = *m_pos++;
+    if (type == 'G')
+        m_valid = readString(m_key);
+    else if (type == 'E')
+        m_valid = readString(m_key) && readString(m_value);
+    else
+        m_valid = false;
+    if (m_valid)
+        m_type = type;
+}
+
+// prints the entries from a group record until the next group, as added or removed
+static void drainGroup(SnapshotReader &reader, const QString &groupPath, bool added, QString &lastPath)
+{
+    for (reader.next(); reader.type() == 'E'; reader.next()) {
+        const QString key = QString::fromUtf8(reader.key()), value = QString::fromUtf8(reader.value());
+        printChange(lastPath, groupPath, key, added ? 0 : &value, added ? &value : 0);
+    }
+}
+
+// like diff(1), 0 if the snapshots are equal, 1 if they differ and 2 on errors
+int diff(const QString &before, const QString &after)
+{
+    QFile beforeFile(before), afterFile(after);
+    QFile *files[2] = { &beforeFile, &afterFile };
+    const char *data[2];
+    for (int i = 0; i < 2; ++i) {
+        const qint64 size = files[i]->size();
+        data[i] = files[i]->open(QIODevice::ReadOnly) && size >= 6 ? reinterpret_cast<const char*>(files[i]->map(0, size)) : 0;
+        if (!data[i] || memcmp(data[i], gs_snapshotMagic, 6)) {
+            out().error(files[i]->fileName(), files[i]->fileName() + " is not a kconfig snapshot");
+            return 2;
+        }
+    }
+    SnapshotReader a(data[0] + 6, beforeFile.size() - 6), b(data[1] + 6, afterFile.size() - 6);
+    bool differ = false;
+    QString lastPath;
+    while ((!a.atEnd() || !b.atEnd()) && a.isValid() && b.isValid()) {
+        if (a.type() != 'G' && !a.atEnd()) {
+            a.next(); // entry without group, only in broken files
+            continue;
+        }
+        const bool onlyA = b.atEnd() || (!a.atEnd() && lessBytes(a.key(), b.key()));
+        const bool onlyB = !onlyA && (a.atEnd() || lessBytes(b.key(), a.key()));
+        if (onlyA || onlyB) {
+            differ = true;
+            SnapshotReader &reader = onlyA ? a : b;
+            drainGroup(reader, QString::fromUtf8(reader.key()), onlyB, lastPath);
+            continue;
+        }
+
+        // the same group in both, walk the entries
+        const QString groupPath = QString::fromUtf8(a.key());
+        a.next();
+        b.next();
+        while (a.type() == 'E' || b.type() == 'E') {
+            const bool removed = b.type() != 'E' || (a.type() == 'E' && lessBytes(a.key(), b.key()));
+            const bool added = !removed && (a.type() != 'E' || lessBytes(b.key(), a.key()));
+            if (removed || added) {
+                SnapshotReader &reader = removed ? a : b;
+                const QString value = QString::fromUtf8(reader.value());
+                printChange(lastPath, groupPath, QString::fromUtf8(reader.key()), removed ? &value : 0, added ? &value : 0);
+                reader.next();
+                differ = true;
+                continue;
+            }
+            if (a.value() != b.value()) {
+                const QString oldValue = QString::fromUtf8(a.value()), value = QString::fromUtf8(b.value());
+                printChange(lastPath, groupPath, QString::fromUtf8(a.key()), &oldValue, &value);
+                differ = true;
+            }
+            a.next();
+            b.next();
+        }
+    }
+    if (!a.isValid() || !b.isValid()) {
+        const QString broken = files[a.isValid() ? 1 : 0]->fileName();
+        out().error(broken, broken + " is truncated or corrupt");
+        return 2;
+    }
+    return differ ? 1 : 0;
+}
+
+// whitespace separated words, '' and "" quote, backslash escapes the next character
+QStringList tokenize(const QString &line)
+{
+    QStringList tokens;
+    QString token;
+    bool inToken = false;
+    QChar quote;
+    for (int i = 0; i < line.length(); ++i) {
+        const QChar c = line.at(i);
+        if (c == '\\' && quote != '\'' && i + 1 < line.length()) {
+            token += line.at(++i);
+            inToken = true;
+        } else if (!quote.isNull()) {
+            if (c == quote)
+                quote = QChar();
+            else
+                token += c;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+            inToken = true;
+        } else if (c.isSpace()) {
+            if (inToken)
+                tokens << token;
+            token.clear();
+            inToken = false;
+        } else {
+            token += c;
+            inToken = true;
+        }
+    }
+    if (inToken)
+        tokens << token;
+    return tokens;
+}
+
+// the files a batch line writes, copygroup and movegroup write the target's as well
+QStringList writtenFiles(const QStringList &args)
+{
+    static const QStringList writers = QStringList() << "write" << "set" << "delete" << "deletegroup" << "replace" << "cas"
+                                                     << "incr" << "setdefault" << "copygroup" << "movegroup" << "renamegroup"
+                                                     << "compact";
+    QStringList files;
+    if (args.count() < 2 || args.at(0).startsWith('#') || !writers.contains(args.at(1)))
+        return files;
+    if (args.at(1) == "compact" && args.value(2) == "--dry-run")
+        return files;
+    QString file = args.at(0);
+    QStringList component;
+    resolveComponent(file, component);
+    files << file;
+    if ((args.at(1) == "copygroup" || args.at(1) == "movegroup") && args.count() > 2) {
+        QString target = args.at(2);
+        resolveComponent(target, component);
+        files << target;
+    }
+    return files;
+}
+
+int runBatch(QFile &input, bool atomic)
+{
+    gs_batch = true;
+    // the locks are held until the end, so all of them are taken up front in one order. Taken line by line,
+    // two batches could each hold a file the other one waits for
+    QList<QStringList> lines;
+    QStringList lockFiles;
+    QTextStream stream(&input);
+    while (!stream.atEnd()) {
+        lines << tokenize(stream.readLine());
+        lockFiles << writtenFiles(lines.last());
+    }
+    QStringList locked;
+    if (!lockConfigs(lockFiles, locked))
+        return 1;
+
+    QHash<QString, KConfig*> configs;
+    int lineNumber = 0, failures = 0;
+    foreach (const QStringList &args, lines) {
+        ++lineNumber;
+        if (args.isEmpty() || args.at(0).startsWith('#'))
+            continue;
+        if (args.count() < 2) {
+            out().error(QString(), QString("Line %1: expected <component> <command> [<key>] [<value>]").arg(lineNumber));
+            ++failures;
+        } else if (execute(args, configs) == Failed) {
+            ++failures;
+        }
+        if (failures && atomic) {
+            out().error(QString(), QString("Batch aborted in line %1, nothing was written").arg(lineNumber));
+            break;
+        }
+    }
+    QStringList files = configs.keys();
+    foreach (const QString &file, gs_syncFirst) {
+        files.removeAll(file);
+        files.prepend(file);
+    }
+    foreach (const QString &file, files) {
+        KConfig *cfg = configs.value(file);
+        if (!cfg)
+            continue;
+        if (failures && atomic) {
+            cfg->markAsClean(); // prevent the destructor from writing anything
+        } else {
+            StatsTimer timer(&Stats::sync);
+            COUNT(syncs);
+            cfg->sync();
+        }
+        delete cfg;
+    }
+    if (!failures || !atomic) {
+        for (int i = 0; i < gs_compacts.count(); ++i) {
+            if (compact(gs_compacts.at(i).first, gs_compacts.at(i).second) == Failed)
+                ++failures;
+        }
+    }
+    foreach (const QString &file, locked)
+        unlockConfig(file);
+    return failures ? 1 : 0;
+}
+
+// the commands that don't write, they can run in parallel and in the server
+bool isQuery(const QString &command)
+{
+    return command == "read" || command == "get" || command == "list" || command == "listkeys" || command == "listgroups" ||
+           command == "find";
+}
+
+bool isGlob(const QString &component)
+{
+    return !component.startsWith('/') && (component.contains('*') || component.contains('?') || component.contains('['));
+}
+
+class FileQuery : public QRunnable
+{
+public:
+    FileQuery(const QStringList &arguments) : args(arguments), status(Continue) { setAutoDelete(false); }
+    void run() {
+        if (!gs_workerOut.hasLocalData())
+            gs_workerOut.setLocalData(new Output(gs_format));
+        QHash<QString, KConfig*> configs; // every worker needs its own KConfig
+        status = execute(args, configs);
+        qDeleteAll(configs);
+        output = gs_workerOut.localData()->take();
+        // unlike list and read, these don't tell where their output came from
+        if (!output.empty() && gs_format == Output::Text && (args.at(1) == "listkeys" || args.at(1) == "listgroups"))
+            output = std::string("\n") + CHAR(args.at(0)) + gs_separator + "\n" + output;
+    }
+    const QStringList args;
+    std::string output;
+    Status status;
+};
+
+// runs the command on every file matching the wildcard in the first part of the component
+int runGlob(const QStringList &args)
+{
+    const int slash = args.at(0).indexOf('/');
+    const QString pattern = args.at(0).left(slash);
+    const QString groups = slash < 0 ? QString() : args.at(0).mid(slash);
+    QStringList names;
+    foreach (const QString &dir, KGlobal::dirs()->resourceDirs("config"))
+        names << QDir(dir).entryList(QStringList() << pattern, QDir::Files);
+    names.sort(); // the order of the output must not depend on the threads
+    names.removeDuplicates();
+    if (names.isEmpty()) {
+        out().error(QString(), "No component matches " + pattern);
+        return 1;
+    }
+
+    gs_multiFile = true;
+    gs_printPath = true;
+    // kdecore doesn't promise that KConfig::sync(), KSaveFile and KStandardDirs::locateLocal() work from several
+    // threads at once, so only the queries run in parallel (without writing indexes), the rest one by one
+    if (!isQuery(args.at(1))) {
+        int ret = 0;
+        foreach (const QString &name, names) {
+            QStringList fileArgs = args;
+            fileArgs[0] = name + groups;
+            QHash<QString, KConfig*> configs;
+            if (execute(fileArgs, configs) == Failed)
+                ret = 1;
+            qDeleteAll(configs);
+        }
+        return ret;
+    }
+    QList<FileQuery*> queries;
+    foreach (const QString &name, names) {
+        QStringList fileArgs = args;
+        fileArgs[0] = name + groups;
+        queries << new FileQuery(fileArgs);
+        QThreadPool::globalInstance()->start(queries.last());
+    }
+    QThreadPool::globalInstance()->waitForDone();
+
+    int ret = 0;
+    foreach (FileQuery *query, queries) {
+        out().write(query->output.data(), query->output.size());
+        if (query->status == Failed)
+            ret = 1;
+        delete query;
+    }
+    return ret;
+}
+
+/**
+ * The server answers with its own locale and config dirs, so the socket is named after them and
+ * clients with another environment don't find it and run the command themselves.
+ */
+QString socketName()
+{
+    static const char *variables[] = { "KDEHOME", "KDEROOTHOME", "KDEDIRS", "XDG_CONFIG_HOME", "XDG_CONFIG_DIRS",
+                                       "KDE_LANG", "LANGUAGE", "LC_ALL", "LC_MESSAGES", "LC_CTYPE", "LANG", 0 };
+    QByteArray environment;
+    for (const char **variable = variables; *variable; ++variable)
+        environment += qgetenv(*variable) + '\0';
+    // the KDE socket dir is private to the user, so nobody else can read or write configs through the server
+    return KStandardDirs::locateLocal("socket", "kconfig-" + QString::number(qHash(environment), 16));
+}
+
+// waits as long as it takes, false if the other side closed the connection before
+bool readMessage(QLocalSocket &socket, QByteArray &message)
+{
+    while (socket.bytesAvailable() < qint64(sizeof(quint32))) {
+        if (!socket.waitForReadyRead(-1))
+            return false;
+    }
+    quint32 size;
+    QDataStream(socket.read(sizeof(quint32))) >> size;
+    while (socket.bytesAvailable() < size) {
+        if (!socket.waitForReadyRead(-1))
+            return false;
+    }
+    message = socket.read(size);
+    return true;
+}
+
+// false unless the whole message was sent
+bool writeMessage(QLocalSocket &socket, const QByteArray &message)
+{
+    QByteArray header;
+    QDataStream(&header, QIODevice::WriteOnly) << quint32(message.size());
+    if (socket.write(header + message) < 0)
+        return false;
+    while (socket.bytesToWrite()) {
+        if (!socket.waitForBytesWritten(5000))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Parsed configs that are kept between calls, for the server and the library.
+ * A config is dropped once any file of its cascade changed, or after a command that writes.
+ */
+class ConfigCache
+{
+public:
+    ~ConfigCache() { qDeleteAll(m_configs); }
+    Status execute(const QStringList &args);
+private:
+    QHash<QString, KConfig*> m_configs;
+    QHash<QString, QList<FileStamp> > m_stamps;
+};
+
+Status ConfigCache::execute(const QStringList &args)
+{
+    QString file = args.at(0);
+    QStringList component;
+    resolveComponent(file, component);
+    // drop the cached config if any file of its cascade changed since it was parsed
+    const QList<FileStamp> current = cascadeStamps(file);
+    if (m_configs.contains(file) && m_stamps.value(file) != current) {
+        delete m_configs.take(file);
+        m_stamps.remove(file);
+    }
+
+    const Status status = ::execute(args, m_configs);
+
+    if (isQuery(args.at(1))) {
+        if (!m_stamps.contains(file) && m_configs.contains(file))
+            m_stamps.insert(file, current);
+    } else if (m_configs.contains(file)) { // we cannot know what others wrote meanwhile, re-parse next time
+        delete m_configs.take(file);
+        m_stamps.remove(file);
+    }
+    return status;
+}
+
+#ifdef KCONFIG_LIBRARY
+/**
+ * The entry point of libkconfigcore, for programs that want to query configs without starting kconfig,
+ * like the zsh module. argv is <component> <command> [<key>] [<value>] [<new value>] (or --components [<filter>])
+ * in the locale encoding,
+ * the text output is returned in a malloc()ed buffer the caller has to free().
+ * Parsed configs are kept for the next call as long as their files do not change.
+ */
+extern "C" int kconfig_query(int argc, const char *const *argv, char **output, int *length)
+{
+    static ConfigCache cache;
+    *output = 0;
+    *length = 0;
+    QStringList args;
+    for (int i = 0; i < argc && i < 5; ++i)
+        args << QString::fromLocal8Bit(argv[i]);
+    const bool components = args.value(0) == "--components";
+    if (args.count() < 2 && !components)
+        return 1;
+
+    Output buffer(Output::Text);
+    gs_out = &buffer;
+    gs_tty = false; // values without decoration, like in $(kconfig ...)
+    const Status status = components ? Status(listComponents(args.value(1))) : cache.execute(args);
+    gs_out = &gs_stdout;
+    const std::string result = buffer.take();
+    *output = static_cast<char*>(malloc(result.size() + 1));
+    if (!*output)
+        return 1;
+    memcpy(*output, result.data(), result.size());
+    (*output)[result.size()] = '\0';
+    *length = result.size();
+    return status == Failed ? 1 : 0;
+}
+#endif
+
+/**
+ * A client of the server. Its request is collected and its reply sent whenever the socket is ready, so a client
+ * that stalls doesn't hold up the others. It's dropped after five seconds without progress.
+ */
+class Connection : public QObject
+{
+public:
+    Connection(int fd, ConfigCache *cache);
+    ~Connection() { ::close(m_fd); }
+protected:
+    bool eventFilter(QObject *watched, QEvent *event);
+    void timerEvent(QTimerEvent *) { deleteLater(); }
+private:
+    bool receive();
+    bool send();
+    QByteArray reply(const QByteArray &request);
+    int m_fd;
+    ConfigCache *m_cache;
+    QByteArray m_data; // the request while it comes in, then the reply
+    int m_sent;
+    QSocketNotifier m_read, m_write;
+    int m_timer;
+};
+
+Connection::Connection(int fd, ConfigCache *cache) : m_fd(fd), m_cache(cache), m_sent(0),
+                                                     m_read(fd, QSocketNotifier::Read), m_write(fd, QSocketNotifier::Write)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    m_write.setEnabled(false);
+    m_read.installEventFilter(this);
+    m_write.installEventFilter(this);
+    m_timer = startTimer(5000);
+}
+
+bool Connection::eventFilter(QObject *watched, QEvent *event)
+{
+    if (event->type() != QEvent::SockAct)
+        return false;
+    const bool progress = watched == &m_read ? receive() : send();
+    if (progress) {
+        killTimer(m_timer);
+        m_timer = startTimer(5000);
+    } else {
+        m_read.setEnabled(false);
+        m_write.setEnabled(false);
+        deleteLater();
+    }
+    return true;
+}
+
+// false once the connection is done with
+bool Connection::receive()
+{
+    char buffer[4096];
+    ssize_t length;
+    while ((length = ::read(m_fd, buffer, sizeof(buffer))) > 0)
+        m_data.append(buffer, length);
+    if (!length || (errno != EAGAIN && errno != EINTR))
+        return false; // the client hung up
+    if (m_data.size() < int(sizeof(quint32)))
+        return true;
+    quint32 size;
+    QDataStream(m_data.left(sizeof(quint32))) >> size;
+    if (size > 1 << 20)
+        return false;
+    if (quint32(m_data.size()) < sizeof(quint32) + size)
+        return true;
+
+    const QByteArray message = reply(m_data.mid(sizeof(quint32), size));
+    if (message.isNull())
+        return false;
+    m_data.clear();
+    QDataStream(&m_data, QIODevice::WriteOnly) << quint32(message.size());
+    m_data += message;
+    m_read.setEnabled(false);
+    m_write.setEnabled(true);
+    return true;
+}
+
+bool Connection::send()
+{
+    while (m_sent < m_data.size()) {
+        const ssize_t length = ::send(m_fd, m_data.constData() + m_sent, m_data.size() - m_sent, MSG_NOSIGNAL);
+        if (length < 0)
+            return errno == EAGAIN || errno == EINTR;
+        m_sent += length;
+    }
+    return false; // all sent
+}
+
+QByteArray Connection::reply(const QByteArray &request)
+{
+    QStringList args;
+    qint32 format;
+    QDataStream(request) >> gs_tty >> format >> args;
+    if (args.count() < 2)
+        return QByteArray();
+    // the server has one thread, a writer waiting for the lock of a file would stall every client
+    if (!isQuery(args.at(1))) {
+        QByteArray reply;
+        QDataStream(&reply, QIODevice::WriteOnly) << qint32(-1) << QByteArray();
+        return reply;
+    }
+
+    Output buffer(Output::Format(format));
+    gs_out = &buffer;
+    const Status status = m_cache->execute(args);
+    gs_out = &gs_stdout;
+    const std::string output = buffer.take();
+
+    QByteArray reply;
+    QDataStream(&reply, QIODevice::WriteOnly) << qint32(status == Failed ? 1 : 0) << QByteArray(output.data(), output.size());
+    return reply;
+}
+
+// hands every client to its own Connection instead of queueing a QLocalSocket
+class CommandServer : public QLocalServer
+{
+public:
+    CommandServer(ConfigCache *cache) : m_cache(cache) {}
+protected:
+    void incomingConnection(quintptr socketDescriptor) { new Connection(socketDescriptor, m_cache); }
+private:
+    ConfigCache *m_cache;
+};
+
+int serve(int &argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    const QString name = socketName();
+    QLocalServer::removeServer(name);
+    ConfigCache cache;
+    CommandServer server(&cache);
+    if (!server.listen(name)) {
+        std::cerr << "Cannot listen on " << CHAR(name) << ": " << CHAR(server.errorString()) << std::endl;
+        return 1;
+    }
+    return app.exec();
+}
+
+// returns the exit code of the server or -1 if none is running or the command has to run here
+int forward(const QStringList &args)
+{
+    if (!qgetenv("KCONFIG_NO_SERVER").isEmpty() || !isQuery(args.at(1)))
+        return -1;
+    QLocalSocket socket;
+    socket.connectToServer(socketName());
+    if (!socket.waitForConnected(100))
+        return -1;
+    QByteArray request;
+    QDataStream(&request, QIODevice::WriteOnly) << bool(IS_A_TTY(1)) << qint32(gs_format) << args;
+    if (!writeMessage(socket, request))
+        return -1; // the server drops incomplete requests
+    // once the server got the request, running it here as well would run it twice
+    QByteArray reply;
+    if (!readMessage(socket, reply)) {
+        std::cerr << "The kconfig server did not answer, the command may or may not have been run" << std::endl;
+        return 1;
+    }
+    qint32 status;
+    QByteArray output;
+    QDataStream(reply) >> status >> output;
+    out().write(output.constData(), output.size());
+    return status;
+}
+
+// microseconds from the start of the process until now, ie. mostly the dynamic linker loading Qt and KDE
+qint64 startupTime()
+{
+#ifdef Q_OS_LINUX
+    QFile stat("/proc/self/stat"), uptime("/proc/uptime");
+    if (!stat.open(QIODevice::ReadOnly) || !uptime.open(QIODevice::ReadOnly))
+        return -1;
+    // the process name can contain spaces, the start time is the 20th field after it
+    const QByteArray fields = stat.readAll();
+    const QList<QByteArray> list = fields.mid(fields.lastIndexOf(')') + 2).split(' ');
+    const double started = list.value(19).toDouble() / sysconf(_SC_CLK_TCK);
+    const double up = uptime.readAll().split(' ').first().toDouble();
+    return qint64((up - started) * 1000000);
+#else
+    return -1;
+#endif
+}
+
+// the counters of the kernel, they include the libraries and the locale files KDE reads
+QHash<QByteArray, qint64> ioCounters()
+{
+    QHash<QByteArray, qint64> counters;
+    QFile io("/proc/self/io");
+    if (io.open(QIODevice::ReadOnly)) {
+        foreach (const QByteArray &line, io.readAll().split('\n')) {
+            const int colon = line.indexOf(':');
+            if (colon > 0)
+                counters.insert(line.left(colon), line.mid(colon + 1).trimmed().toLongLong());
+        }
+    }
+    return counters;
+}
+
+void printStats()
+{
+    gs_stdout.flush();
+    Stats &st = *gs_stats;
+    QMutexLocker locker(&st.mutex);
+    const qint64 total = now() - st.start;
+    // the workers of multi file queries run in parallel, so the phases can add up to more than the total
+    const qint64 query = qMax(qint64(0), total - st.parse - st.sync - st.output);
+    const QHash<QByteArray, qint64> io = ioCounters();
+    const qint64 read = io.value("rchar", -1), written = io.value("wchar", -1);
+    if (st.json) {
+        std::cerr << "{\"startup_us\":" << st.startup << ",\"parse_us\":" << st.parse << ",\"query_us\":" << query
+                  << ",\"output_us\":" << st.output << ",\"sync_us\":" << st.sync << ",\"total_us\":" << total
+                  << ",\"files\":" << int(st.files) << ",\"groups\":" << int(st.groups) << ",\"matches\":" << int(st.matches)
+                  << ",\"regexps\":" << int(st.regExps) << ",\"syncs\":" << int(st.syncs) << ",\"output_bytes\":" << st.outputBytes
+                  << ",\"read_bytes\":" << read << ",\"written_bytes\":" << written << "}" << std::endl;
+        return;
+    }
+#define MS(_T_) CHAR(QString::number(_T_ / 1000.0, 'f', 3).rightJustified(10))
+    std::cerr << "startup " << (st.startup < 0 ? "         ?" : MS(st.startup)) << " ms  until main()\n"
+              << "parse   " << MS(st.parse) << " ms  " << int(st.files) << " files\n"
+              << "query   " << MS(query) << " ms  " << int(st.groups) << " groups visited, " << int(st.matches)
+                                          << " pattern matches, " << int(st.regExps) << " of them regexps\n"
+              << "output  " << MS(st.output) << " ms  " << st.outputBytes << " bytes\n"
+              << "sync    " << MS(st.sync) << " ms  " << int(st.syncs) << " calls\n"
+              << "total   " << MS(total) << " ms  " << read << " bytes read, " << written << " bytes written\n";
+#undef MS
+    std::cerr.flush();
+}
+
+// runs the command through KConfig and the mapped files, prints the KConfig result and complains if they differ
+int verifyMapped(const QStringList &args)
+{
+    Output reference(gs_format), mapped(gs_format);
+    Status status[2];
+    for (int i = 0; i < 2; ++i) {
+        gs_mapped = i;
+        gs_useIndex = false;
+        gs_out = i ? &mapped : &reference;
+        QHash<QString, KConfig*> configs;
+        status[i] = execute(args, configs);
+        foreach (KConfig *cfg, configs)
+            delete cfg;
+    }
+    gs_out = &gs_stdout;
+    const std::string expected = reference.take(), result = mapped.take();
+    out().write(expected.data(), expected.size());
+    if (status[0] != status[1] || expected != result) {
+        std::cerr << "The mapped reader differs from KConfig, it printed:" << std::endl;
+        std::cerr.write(result.data(), result.size());
+        std::cerr << std::endl;
+        return 1;
+    }
+    return status[0] == Failed ? 1 : 0;
+}
+
+#ifndef KCONFIG_LIBRARY
+int main (int argc, char **argv)
+{
+    QStringList args;
+    for (int i = 1; i < argc; ++i)
+        args << QString::fromLocal8Bit(argv[i]);
+
+    while (!args.isEmpty() && args.first().startsWith("--format=")) {
+        const QString format = args.takeFirst().mid(9);
+        if (format == "text") {
+            gs_format = Output::Text;
+        } else if (format == "json") {
+            gs_format = Output::Json;
+        } else if (format == "tsv") {
+            gs_format = Output::Tsv;
+        } else if (format == "nul") {
+            gs_format = Output::Nul;
+        } else {
+            std::cerr << "Unknown format: " << CHAR(format) << std::endl;
+            exit(1);
+        }
+        gs_stdout.setFormat(gs_format);
+    }
+
+    bool verify = false;
+    while (!args.isEmpty() && (args.first() == "--fast" || args.first() == "--verify" || args.first().startsWith("--stats") ||
+                               args.first().startsWith("--layer=") || args.first() == "--no-globals" || args.first() == "--show-layer")) {
+        const QString option = args.takeFirst();
+        if (option == "--no-globals") {
+            gs_noGlobals = true;
+            continue;
+        }
+        if (option == "--show-layer") {
+            gs_showLayer = true;
+            continue;
+        }
+        if (option.startsWith("--layer=")) {
+            const QString layer = option.mid(8);
+            if (layer == "all") {
+                selectLayer(AllLayers);
+            } else if (layer == "user") {
+                selectLayer(UserLayer);
+            } else if (layer == "system") {
+                selectLayer(SystemLayer);
+            } else {
+                std::cerr << "Unknown layer: " << CHAR(layer) << std::endl;
+                exit(1);
+            }
+            continue;
+        }
+        if (option == "--stats" || option == "--stats=json") {
+            if (!gs_stats) {
+                gs_stats = new Stats();
+                gs_stats->start = now();
+                gs_stats->startup = startupTime();
+                atexit(printStats);
+            }
+            gs_stats->json = option == "--stats=json";
+            continue;
+        }
+        if (option.startsWith("--stats")) {
+            std::cerr << "Unknown option: " << CHAR(option) << std::endl;
+            exit(1);
+        }
+        verify = verify || option == "--verify";
+        gs_mapped = true;
+    }
+
+    if (!args.isEmpty() && args.first() == "--batch") {
+        args.removeFirst();
+        const bool atomic = !args.isEmpty() && args.first() == "--atomic";
+        if (atomic)
+            args.removeFirst();
+        QFile input;
+        if (!args.isEmpty()) {
+            input.setFileName(args.first());
+            if (!input.open(QIODevice::ReadOnly | QIODevice::Text)) {
+                std::cerr << "Cannot read " << CHAR(args.first()) << std::endl;
+                exit(1);
+            }
+        } else {
+            input.open(stdin, QIODevice::ReadOnly | QIODevice::Text);
+        }
+        exit(runBatch(input, atomic));
+    }
+
+    if (args.count() == 1 && args.first() == "serve")
+        exit(serve(argc, argv));
+
+    if (args.count() == 2 && args.first() == "snapshot")
+        exit(snapshot(args.at(1)));
+
+    if (args.count() == 3 && args.first() == "diff")
+        exit(diff(args.at(1), args.at(2)));
+
+    if (!args.isEmpty() && args.first() == "--components")
+        exit(listComponents(args.value(1)));
+
+    if (args.count() < 2) {
+        usage();
+        exit(1);
+    }
+
+    args = args.mid(0, 5);
+    if (verify)
+        exit(verifyMapped(args));
+    if (args.at(1) == "watch") {
+#ifdef Q_OS_LINUX
+        exit(watch(args));
+#else
+        std::cerr << "watch is only supported on Linux" << std::endl;
+        exit(1);
+#endif
+    }
+    if (isGlob(args.at(0).section('/', 0, 0)))
+        exit(runGlob(args));
+    // the server only knows the whole cascade
+    const bool wholeCascade = gs_layer == AllLayers && !gs_noGlobals && !gs_showLayer;
+    const int forwarded = gs_mapped || gs_stats || !wholeCascade ? -1 : forward(args);
+    if (forwarded > -1)
+        exit(forwarded);
+    QHash<QString, KConfig*> configs;
+    const Status status = execute(args, configs);
+    foreach (KConfig *cfg, configs)
+        delete cfg;
+    exit(status == Failed ? 1 : 0);
+}
+#endif
@@ -0,0 +1,333 @@
+#!/bin/sh
+# times every kconfig command on synthetic rc files and prints one JSON object per measurement:
+# {"mode":..., "groups":..., "cache":"cold"|"warm", "runs":..., "p50_ms":..., "p90_ms":..., "p99_ms":..., "max_ms":..., "peak_rss_kb":...}
+#
+# ./kconfig_bench.sh [-n <runs>] [-b <kconfig binary>] [<groups> ...]    (default: 10 1000 100000 groups)
+# ./kconfig_bench.sh -s <writers> [-n <writes>] [-b <kconfig binary>]
+# ./kconfig_bench.sh -d [-b <kconfig binary>]
+#
+# cold runs start from a fresh copy of the file without the completion index and with the page cache dropped,
+# which needs root - otherwise they are skipped with a note on stderr. warm runs repeat the command on the same file - the commands that change it get a fresh
+# copy before every run, so they don't measure "not found" from the second run on. compare two builds with eg.
+#     ./kconfig_bench.sh > before.json; ...; ./kconfig_bench.sh > after.json; paste -d'\n' before.json after.json
+#
+# -s runs <writers> processes that each write <writes> times to their own key of one shared file at the
+# same time and increment a shared counter as often, then checks that every key holds its last value and
+# that no increment got lost: {"writers":..., "writes":..., "seconds":..., "lost":...}
+# then two --batch processes increment counters in the same two files <writes> times, in opposite order,
+# and it checks that none hung (for 10s) or lost an increment: {"batches":2, ..., "deadlocks":...}
+#
+# -d compares the mapped reader (--fast) with KConfig: it runs read, list, listkeys and listgroups with --verify
+# on a generated cascade with escapes, [$i] files, groups and entries, $e entries and translations, in several
+# languages and with a kiosk ([$i]) kdeglobals, and prints the commands whose results differ and
+# {"verified":..., "differences":...}
+
+RUNS=20
+KCONFIG=./kconfig
+WRITERS=0
+DIFFERENTIAL=0
+while getopts "n:b:s:d" opt; do
+    case $opt in
+        n) RUNS=$OPTARG ;;
+        b) KCONFIG=$OPTARG ;;
+        s) WRITERS=$OPTARG ;;
+        d) DIFFERENTIAL=1 ;;
+        *) sed -n '5,7p' "$0" | sed 's/^# //'; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+SIZES=${*:-10 1000 100000}
+
+if [ ! -x "$KCONFIG" ]; then
+    echo "$KCONFIG not found, run ./make_kconfig.sh first" >&2
+    exit 1
+fi
+TIME=`which time 2>/dev/null`
+[ -n "$TIME" ] && "$TIME" -f %M true >/dev/null 2>&1 || TIME=""
+
+export KCONFIG_NO_SERVER=1 # measure the tool, not the server
+WORK=`mktemp -d /tmp/kconfig_bench.XXXXXX`
+trap 'rm -rf "$WORK"' EXIT
+CACHE="`kde4-config --path cache | cut -d: -f1`kconfig"
+
+# <groups> flat groups with 10 keys each, every tenth key with 4k value and every group with a few
+# translated entries, plus a tree 8 levels deep below [Deep]
+generate() {
+    awk -v groups=$1 'BEGIN {
+        long = sprintf("%4096s", ""); gsub(/ /, "x", long)
+        for (g = 0; g < groups; ++g) {
+            printf "[Group %d]\n", g
+            for (k = 0; k < 10; ++k)
+                printf "Key%d=%s\n", k, (k == 9) ? long : "value " g "-" k
+            printf "Name=Group %d\nName[de]=Gruppe %d\nName[fr]=Groupe %d\nName[sr@latin]=Grupa %d\n\n", g, g, g, g
+        }
+        path = "[Deep]"
+        for (d = 0; d < 8; ++d) {
+            path = path "[Level " d "]"
+            for (s = 0; s < 4; ++s)
+                printf "%s[Leaf %d]\nKey=deep %d-%d\nOther=value\n\n", path, s, d, s
+        }
+    }'
+}
+
+# prints the elapsed microseconds and the peak rss (kB, or null) of one run
+measure() {
+    start=`date +%s%N`
+    if [ -n "$TIME" ]; then
+        rss=`"$TIME" -f %M "$KCONFIG" "$@" 2>&1 >/dev/null | tail -n1`
+    else
+        "$KCONFIG" "$@" >/dev/null 2>&1
+        rss=null
+    fi
+    end=`date +%s%N`
+    echo "$(( (end - start) / 1000 )) $rss"
+}
+
+# <mode name> <groups> <cold|warm> <option> <group path> <command> [<key>] [<value>]
+# the component is the generated file, <option> is put in front of it unless it's empty
+bench() {
+    name=$1; groups=$2; cache=$3; option=$4; group=$5; shift 5
+    case $1 in
+        write|replace|delete|deletegroup) restore=1 ;;
+        *) restore=0 ;;
+    esac
+    for i in `seq $RUNS`; do
+        if [ "$cache" = cold ] || [ $i = 1 ] || [ $restore = 1 ]; then
+            cp "$WORK/template.rc" "$WORK/bench.rc"
+        fi
+        if [ "$cache" = cold ]; then
+            rm -f "$CACHE"/*kconfig_bench*.idx 2>/dev/null
+            sync
+            echo 1 > /proc/sys/vm/drop_caches
+        fi
+        if [ -n "$option" ]; then
+            measure "$option" "$WORK/bench.rc$group" "$@"
+        else
+            measure "$WORK/bench.rc$group" "$@"
+        fi
+    done | sort -n | awk -v mode="$name" -v groups=$groups -v cache=$cache '
+        { us[NR] = $1; if ($2 != "null" && $2 > rss) rss = $2 }
+        function pct(p) { i = int(NR * p + 0.999); if (i < 1) i = 1; return us[i] / 1000 }
+        END { printf "{\"mode\":\"%s\",\"groups\":%d,\"cache\":\"%s\",\"runs\":%d,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,\"peak_rss_kb\":%s}\n",
+                    mode, groups, cache, NR, pct(0.5), pct(0.9), pct(0.99), us[NR] / 1000, rss ? rss : "null" }'
+}
+
+if [ $DIFFERENTIAL = 1 ]; then
+    # a cascade of its own: the system wide files below $KDEDIRS, the user's below $KDEHOME
+    export KDEHOME="$WORK/home" KDEDIRS="$WORK/system"
+    SYSTEMDIR="$WORK/system/share/config"
+    USERDIR="$WORK/home/share/config"
+    mkdir -p "$SYSTEMDIR" "$USERDIR"
+    printf '[General]\nFixed[$i]=system\nShared=system\n\n[Locale]\nCountry=de\n' > "$SYSTEMDIR/kdeglobals"
+    printf '[General]\nFixed=user\nShared=user\nUserOnly=1\n' > "$USERDIR/kdeglobals"
+    cat > "$SYSTEMDIR/diffrc" <<'RC'
+Root=system root
+[Escapes]
+Spaces=\sleading and trailing\s
+Controls=tab\there\nnew line\rreturn
+Hex=\x41\x42\x7e and \x4
+Backslash=a\\b\\
+Unknown=\q\
+Key\swith\sspace=escaped key
+Equals=a=b=c
+Empty=
+
+[Locked][$i]
+Key=system
+Name=System
+Name[de]=System (de)
+
+[Names]
+Name=Name
+Name[de]=Name (de)
+Name[de_DE]=Name (de_DE)
+Name[sr@latin]=Ime
+Comment[de]=only translated
+Other[fr]=nom
+Caption=caption
+Caption[C]=C caption
+
+[Nested][Child]
+Key=system child
+[Nested][Child][Leaf]
+Key=system leaf
+
+[Entries]
+Fixed[$i]=system
+Free=system
+Translated[de][$i]=fixed (de)
+Translated=system
+  Indented  =  spaced value
+RC
+    cat > "$USERDIR/diffrc" <<'RC'
+Root=user root
+[Escapes]
+Hex=\x61\x62
+Mixed=caf\xc3\xa9 \\s
+
+[Locked]
+Key=user
+Added=user
+
+[Names]
+Name[de]=Benutzer (de)
+Name[sr@latin]=Korisnik
+Caption=user caption
+
+[Nested][Child]
+Key=user child
+[Nested][Other]
+Key=user other
+
+[Entries]
+Fixed=user
+Free=user
+Translated[de]=user (de)
+Translated=user
+broken line without equals
+[unterminated
+Trailing=after broken lines
+RC
+    printf '[$i]\n[General]\nKey=system\n' > "$SYSTEMDIR/lockedrc"
+    printf '[General]\nKey=user\nOther=user\n' > "$USERDIR/lockedrc"
+    printf '[Paths]\nHome[$e]=$HOME/x\nPlain=plain\n' > "$USERDIR/expandrc"
+    printf '[General]\nGone[$d]\nKept=1\n' > "$USERDIR/deletedrc"
+    # like plasma-appletsrc, the groups on the way to the [General]s have no entries of their own
+    printf '[General]\nKey=toplevel\n\n[Containments][1][General]\nKey=nested\n\n[Containments][2][Applets][3][General]\nKey=deep\n' \
+        > "$USERDIR/appletsrc"
+
+    verified=0
+    differences=0
+    # <command> [<arguments>], --verify prints what the mapped reader found on stderr if the results differ
+    verify() {
+        verified=$((verified + 1))
+        if "$KCONFIG" --verify "$@" 2>&1 >/dev/null | grep -q "differs from KConfig"; then
+            differences=$((differences + 1))
+            echo "differs with KDE_LANG=${KDE_LANG:-}: kconfig $*" >&2
+        fi
+    }
+    for lang in "" de de_DE sr@latin fr C; do
+        export KDE_LANG=$lang
+        for component in diffrc lockedrc expandrc deletedrc kdeglobals "$USERDIR/diffrc"; do
+            verify "$component" list
+            verify "$component" listgroups
+        done
+        for group in Escapes Locked Names Nested Nested/Child Nested/Child/Leaf Nested/Other Entries Missing; do
+            verify "diffrc/$group" list
+            verify "diffrc/$group" listkeys
+            verify "diffrc/$group" listgroups
+            for key in Spaces Controls Hex Backslash Unknown "Key with space" Equals Empty Mixed Key Name Comment Other \
+                       Caption Added Fixed Free Translated Indented Trailing Missing; do
+                verify "diffrc/$group" read "$key"
+            done
+        done
+        verify diffrc read Root
+        verify "diffrc/Nes.*/Ch.*" list
+        verify "diffrc/**/Leaf" list
+        verify "appletsrc/**/General" list
+        verify "appletsrc/Containments/**/General" list
+        verify kdeglobals/General list
+        verify lockedrc/General list
+        verify expandrc/Paths read Home
+        verify deletedrc/General list
+    done
+    # a kiosk kdeglobals ends only the globals, the files of the component are read all the same
+    printf '[$i]\n[General]\nFixed=kiosk\nKiosk=1\n' > "$SYSTEMDIR/kdeglobals"
+    printf '[General]\nShared=system.kdeglobals\nSystemGlobals=1\n' > "$SYSTEMDIR/system.kdeglobals"
+    export KDE_LANG=
+    for component in diffrc lockedrc kdeglobals; do
+        verify "$component" list
+        verify "$component" listgroups
+    done
+    verify diffrc/Entries list
+    verify diffrc/General list
+    verify kdeglobals/General list
+    verify diffrc read Root
+    # both readers could be wrong the same way, this one has to find the two nested groups and nothing else
+    verified=$((verified + 1))
+    nested=`"$KCONFIG" "appletsrc/Containments/**/General" list 2>&1`
+    if ! echo "$nested" | grep -q nested || ! echo "$nested" | grep -q deep || echo "$nested" | grep -q -e toplevel -e "Groups in"; then
+        differences=$((differences + 1))
+        echo "kconfig appletsrc/Containments/**/General list printed:" >&2
+        echo "$nested" >&2
+    fi
+    echo "{\"verified\":$verified,\"differences\":$differences}"
+    [ $differences = 0 ]
+    exit
+fi
+
+if [ $WRITERS -gt 0 ]; then
+    printf '[Stress]\nShared=0\n' > "$WORK/stress.rc"
+    start=`date +%s%N`
+    for w in `seq $WRITERS`; do
+        (
+            for i in `seq $RUNS`; do
+                "$KCONFIG" "$WORK/stress.rc/Stress" set "Writer$w" $i >/dev/null || echo "writer $w failed" >&2
+                "$KCONFIG" "$WORK/stress.rc/Stress" incr Shared >/dev/null || echo "writer $w failed" >&2
+            done
+        ) &
+    done
+    wait
+    end=`date +%s%N`
+    lost=0
+    for w in `seq $WRITERS`; do
+        [ "`"$KCONFIG" "$WORK/stress.rc/Stress" get "Writer$w"`" = "$RUNS" ] || lost=$((lost + 1))
+    done
+    shared=`"$KCONFIG" "$WORK/stress.rc/Stress" get Shared`
+    lost=$((lost + WRITERS * RUNS - ${shared:-0}))
+    echo "{\"writers\":$WRITERS,\"writes\":$((2 * WRITERS * RUNS)),\"seconds\":$(( (end - start) / 1000000 ))e-3,\"lost\":$lost}"
+    [ $lost = 0 ] || failed=1
+
+    # a batch holds its locks until its final sync, with the files in opposite order each could wait for the other
+    printf '[Stress]\nShared=0\n' > "$WORK/a.rc"
+    cp "$WORK/a.rc" "$WORK/b.rc"
+    TIMEOUT=`which timeout 2>/dev/null`
+    start=`date +%s%N`
+    for order in "a b" "b a"; do
+        (
+            set -- $order
+            for i in `seq $RUNS`; do
+                printf '%s incr Shared\n' "$WORK/$1.rc/Stress" "$WORK/$2.rc/Stress" |
+                    $TIMEOUT ${TIMEOUT:+10} "$KCONFIG" --batch >/dev/null
+                case $? in
+                    0) ;;
+                    124) echo "$order" >> "$WORK/deadlocks" ;;
+                    *) echo "batch $order failed" >&2 ;;
+                esac
+            done
+        ) &
+    done
+    wait
+    end=`date +%s%N`
+    deadlocks=`cat "$WORK/deadlocks" 2>/dev/null | wc -l`
+    a=`"$KCONFIG" "$WORK/a.rc/Stress" get Shared`
+    b=`"$KCONFIG" "$WORK/b.rc/Stress" get Shared`
+    lost=$((4 * RUNS - ${a:-0} - ${b:-0}))
+    echo "{\"batches\":2,\"writes\":$((4 * RUNS)),\"seconds\":$(( (end - start) / 1000000 ))e-3,\"lost\":$lost,\"deadlocks\":$deadlocks}"
+    [ $lost = 0 ] && [ $deadlocks = 0 ] && [ -z "$failed" ]
+    exit
+fi
+
+# a cold run that still reads from the page cache would be a warm one
+COLD=cold
+if ! (echo 1 > /proc/sys/vm/drop_caches) 2>/dev/null; then
+    echo "Cannot drop the page cache (not root?), skipping the cold runs" >&2
+    COLD=
+fi
+
+for groups in $SIZES; do
+    generate $groups > "$WORK/template.rc"
+    middle=$((groups / 2))
+    for cache in $COLD warm; do
+        bench read        $groups $cache "" "/Group $middle" read Key3
+        bench write       $groups $cache "" "/Group $middle" write Key3 changed
+        bench list        $groups $cache "" "/Group $middle" list
+        bench listkeys    $groups $cache "" "/Group $middle" listkeys
+        bench listgroups  $groups $cache "" "/Group $middle" listgroups
+        bench replace     $groups $cache "" "/Group $middle" replace "Key(.*)=value(.*)" "Key\\1=new\\2"
+        bench delete      $groups $cache "" "/Group $middle" delete Key3
+        bench deletegroup $groups $cache "" "" deletegroup "Group $middle"
+        bench read-fast   $groups $cache --fast "/Group $middle" read Key3
+        bench regex-path  $groups $cache "" "/Deep/Level.*/Level [0-3]/Leaf.*" list Key
+    done
+done
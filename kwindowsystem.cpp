@@ -19,18 +19,37 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 *********************************************************************/
 
 #include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
 
 #include <QApplication>
-#include <QDesktopWidget>
 #include <QDialog>
 
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QLocalServer>
+#include <QLocalSocket>
 #include <QMetaObject>
+#include <QMargins>
 #include <QMouseEvent>
+#include <QPair>
+#include <QRegExp>
+#include <QSet>
+#include <QSocketNotifier>
+#include <QTextStream>
+#include <QVector>
 #include <QX11Info>
 
 #include <KWindowSystem>
 #include <NETRootInfo>
 
+#include <X11/Xlib-xcb.h>
+#include <X11/extensions/Xinerama.h>
+#include <xcb/xcb.h>
+
 
 class WindowPicker : public QDialog
 {
@@ -69,17 +88,32 @@ protected:
     #define IS_A_TTY(_I_) _isatty(_I_)
 #else
     #include <unistd.h>
+    #include <fcntl.h>
+    #include <sys/socket.h>
     #define IS_A_TTY(_I_) isatty(_I_)
+    #ifndef MSG_NOSIGNAL
+        #define MSG_NOSIGNAL 0
+    #endif
 #endif
+#include <sys/stat.h>
+#include <cerrno>
 
 #define CHAR(_S_) _S_.toLocal8Bit().data()
 
-#define FINISH a.processEvents(); exit(0)
-#define INFO(_C_, _F_) if (command == _C_) { std::cout << CHAR(toString(KWindowSystem::_F_())) << std::endl; FINISH; }
-#define REQUIRE_WID if (argc < 3) printHelp("nowindow", command); const int wid = window(QString::fromLocal8Bit(argv[2]))
-#define WIN_FUNC(_C_, _F_) if (command == _C_) { REQUIRE_WID; KWindowSystem::_F_(wid); FINISH; }
+#define FINISH if (flush) XFlush(display()); return 0
+#define INFO(_C_, _F_) if (command == _C_) { out() << CHAR(toString(WindowSystem::_F_())) << std::endl; FINISH; }
+#define REQUIRE_WID if (argc < 3) return printHelp("nowindow", command); \
+                    if (isSelector(args.at(2))) return forEachWindow(args, 2, flush); \
+                    WId wid; if (!window(args.at(2), &wid)) return 1
+#define WIN_FUNC(_C_, _F_) if (command == _C_) { REQUIRE_WID; WindowSystem::_F_(wid); FINISH; }
+
+static bool gs_batch = false; // a batch looks every window up once
+static bool gs_noPick = false; // --batch runs without the user (and maybe with the server grabbed), nobody can click a window
+static std::ostream *gs_out = &std::cout; // the server redirects this into the reply for its client
+inline std::ostream &out() { return *gs_out; }
 
-void printHelp(QString topic = QString(), QString parameter = QString())
+// returns the exit code
+int printHelp(QString topic = QString(), QString parameter = QString())
 {
     static const char *setHelp = "* set <window id> desktop <desktop id>|all\n  sets a window on a particular or \"all\" virtual desktops\n"
         "* set <window id> urgent\n  make window blink in the taskbar\n"
@@ -115,58 +149,85 @@ void printHelp(QString topic = QString(), QString parameter = QString())
         "        ---------\n"
         "The <desktop id> must refer to either a valid number (counting starts with 1) or the name of a virtual desktop\n"
         "NOTICE that if it is a name, ONLY THE FIRST matching (exact and case sensitive!) virtual desktop is affected";
+    static const char *watchHelp = "* watch [--json] [<events>]\n"
+        "  prints a line for every change until it's killed, <events> is a comma separated list of\n"
+        "    active,mapped,unmapped,name,desktop,state,geometry,currentdesktop,desktopcount,desktopnames\n"
+        "  (all by default). Window events carry the fields of \"list\", --json prints one object per line\n";
+    static const char *tileHelp = "* tile grid|columns|master-stack|cascade [<window id>]\n"
+        "  arranges the windows (by default \"type=Normal,desktop=current,state!=minimized\", see below) in the\n"
+        "  available area of the screen they are on. master-stack gives the topmost one the left half\n";
+    static const char *batchHelp = "* --batch [--grab] [<file>]\n"
+        "  reads one command per line (like the arguments of kwindowsystem, they can be quoted) from <file> or\n"
+        "  stdin and runs them on one connection. Windows are looked up once, the events a line caused are\n"
+        "  taken in before the next one. With --grab the X server is grabbed meanwhile, so the changes show up at once.\n"
+        "  desktop add, remove and setCount wait for the window manager and cannot run in a batch.\n"
+        "  Nobody is there to click a window, \"pick\" and id without \"active\" fail in a batch\n";
     static const char *windowHelp = "Determinig a window\n          ---------\n"
         "<window id> can be:\n"
         "* an actual window ID (decimal or hexadecimal)\n"
         "* an alias \"active\", \"pick\" or \"none\"\n"
         "* a string matching either the window class (usually the appname) or the window title\n"
         "  NOTICE that this is heuristic and the first perfect or otherwise \"best™\" match is taken\n"
+        "* a selector like \"class=firefox,desktop=3,type=Normal,title~=regex,state=minimized\", commands act\n"
+        "  on all windows that match every criterion (the first one where only one window makes sense).\n"
+        "  Keys are id,class,name,title,type,desktop,state; = ignores the case, != negates it, ~= is a\n"
+        "  regular expression, \\, is a comma in a value\n"
         "=> Try \"kwindowsystem list\"";
     if (topic.isEmpty() || topic == "unknowncommand") {
-        std::cout << "\nUsage:\n-------------------------------\n"
+        out() << "\nUsage:\n-------------------------------\n"
         "* isComposited\n  print true or false, depending on whether a compositor is active\n"
         "* active\n  print the currently active <window id>\n"
         "* id [active]\n  print the id of the active or to be picked window\n\n"
+        "* serve\n  keeps one X connection and the windows in memory and runs all other kwindowsystem calls on this\n"
+        "  display, which transparently use it while it is running (export KWINDOWSYSTEM_NO_SERVER=1 to bypass it)\n\n"
         "* activate <window id>\n"
         "* lower <window id>\n"
         "* raise <window id>\n"
         "* minimize <window id>\n"
         "* unminimize <window id>\n"
         "* close <window id>\n"
-        << setHelp << statesHelp <<
+        << tileHelp << watchHelp << batchHelp << setHelp << statesHelp <<
         "\n\n\n  " << deskHelp << "\n\n\n  " << windowHelp << std::endl;
     } else if (topic == "falsedesk") {
-        std::cout << "No such desktop: " << CHAR(parameter) << std::endl;
+        out() << "No such desktop: " << CHAR(parameter) << std::endl;
     } else if (topic == "falsewindow") {
-        std::cout << "No such window: " << CHAR(parameter) << "\n\n\n  " << windowHelp << "\n" <<  std::endl;
+        out() << "No such window: " << CHAR(parameter) << "\n\n\n  " << windowHelp << "\n" <<  std::endl;
     } else if (topic == "nowindow") {
-        std::cout << "The (sub)command " << CHAR(parameter) << " expects a window ID or \"active\" as next argument" << std::endl;
+        out() << "The (sub)command " << CHAR(parameter) << " expects a window ID or \"active\" as next argument" << std::endl;
     } else if (topic == "desktop") {
-        std::cout << deskHelp << std::endl;
+        out() << deskHelp << std::endl;
     } else if (topic == "deskcount") {
-        std::cout << "\"desktop setCount <NUMBER>\" expects a number > 0 as parameter" << std::endl;
+        out() << "\"desktop setCount <NUMBER>\" expects a number > 0 as parameter" << std::endl;
     } else if (topic == "set") {
-        std::cout << setHelp << statesHelp << std::endl;
+        out() << setHelp << statesHelp << std::endl;
     } else if (topic == "states") {
-        std::cout << statesHelp << std::endl;
+        out() << statesHelp << std::endl;
     } else if (topic == "setdesktop") {
-        std::cout << "\"set <window id> desktop <DESKTOP ID>\" expects the number or name of a desktop as last parameter" << std::endl;
+        out() << "\"set <window id> desktop <DESKTOP ID>\" expects the number or name of a desktop as last parameter" << std::endl;
     } else if (topic == "setgeometry") {
-        std::cout << "\"set <window id> geometry <GEOMETRY>\" expects an X11 conformant geometry string [=][<width>{xX}<height>][{+-}<xoffset>{+-}<yoffset>]" << std::endl;
+        out() << "\"set <window id> geometry <GEOMETRY>\" expects an X11 conformant geometry string [=][<width>{xX}<height>][{+-}<xoffset>{+-}<yoffset>]" << std::endl;
+    } else if (topic == "tile") {
+        out() << "Unknown layout: " << CHAR(parameter) << "\n" << tileHelp << std::endl;
+    } else if (topic == "selector") {
+        out() << "Invalid criterion: " << CHAR(parameter) << "\n\n\n  " << windowHelp << std::endl;
+    } else if (topic == "watch") {
+        out() << "Unknown event: " << CHAR(parameter) << "\n" << watchHelp << std::endl;
+    } else if (topic == "nopick") {
+        out() << "A batch cannot pick a window, use its id or a selector" << std::endl;
     } else if (topic == "transient") {
-        std::cout << "\"set <window id> transientFor <window id>\" expects a second window as parameter for the main window" << std::endl;
+        out() << "\"set <window id> transientFor <window id>\" expects a second window as parameter for the main window" << std::endl;
     } else {
-        std::cout << "error: " << CHAR(topic) << std::endl;
+        out() << "error: " << CHAR(topic) << std::endl;
     }
 
-    exit(1);
+    return 1;
 }
 
 inline QString toString(WId w) { return QString::number(w); }
 inline QString toString(int i) { return QString::number(i); }
 inline QString toString(bool b) { return b ? "true" : "false"; }
 inline QString toString(const QRect &r) {
-    QString ret = QString::number(r.width()) + "x" + QString::number(r.width());
+    QString ret = QString::number(r.width()) + "x" + QString::number(r.height());
     if (r.x() > -1)
         ret += '+';
     ret += QString::number(r.x());
@@ -176,14 +237,133 @@ inline QString toString(const QRect &r) {
     return ret;
 }
 
+/**
+ * A QApplication costs more than most commands, so it's only created to pick a window. Everything else
+ * talks to the X server on its own connection, through NETRootInfo and NETWinInfo instead of KWindowSystem.
+ */
+static int gs_argc;
+static char **gs_argv;
+static Display *gs_display = 0;
+
+Display *display()
+{
+    if (!gs_display)
+        gs_display = qApp ? QX11Info::display() : XOpenDisplay(0);
+    return gs_display;
+}
+
+inline Window rootWindow() { return DefaultRootWindow(display()); }
+
+// read once per process, the server keeps it up to date from the root window events
+NETRootInfo &rootInfo()
+{
+    static const unsigned long properties[2] = {
+        NET::Supported|NET::ActiveWindow|NET::NumberOfDesktops|NET::CurrentDesktop|NET::DesktopNames|NET::WorkArea,
+        NET::WM2ShowingDesktop
+    };
+    static NETRootInfo *info = new NETRootInfo(display(), properties, 2);
+    return *info;
+}
+
+WId pickWindow()
+{
+    if (!qApp)
+        new QApplication(gs_argc, gs_argv);
+    return WindowPicker().pick();
+}
+
+// the KWindowSystem functions the commands use
+namespace WindowSystem
+{
+WId activeWindow() { return rootInfo().activeWindow(); }
+bool compositingActive()
+{
+    const QByteArray name = "_NET_WM_CM_S" + QByteArray::number(DefaultScreen(display()));
+    return XGetSelectionOwner(display(), XInternAtom(display(), name.constData(), False)) != None;
+}
+int numberOfDesktops() { return rootInfo().numberOfDesktops(); }
+int currentDesktop() { return rootInfo().currentDesktop(); }
+void setCurrentDesktop(int desktop) { rootInfo().setCurrentDesktop(desktop); }
+bool showingDesktop() { return rootInfo().showingDesktop(); }
+QString desktopName(int desktop) { return QString::fromUtf8(rootInfo().desktopName(desktop)); }
+void setDesktopName(int desktop, const QString &name) { rootInfo().setDesktopName(desktop, name.toUtf8().constData()); }
+// nothing to read, it's a client message
+void setOnDesktop(WId wid, int desktop) { NETWinInfo(display(), wid, rootWindow(), 0).setDesktop(desktop); }
+void setOnAllDesktops(WId wid, bool set) { setOnDesktop(wid, set ? int(NET::OnAllDesktops) : currentDesktop()); }
+void forceActiveWindow(WId wid) { rootInfo().setActiveWindow(wid, NET::FromTool, CurrentTime, None); }
+// a WM without _NET_RESTACK_WINDOW gets the plain X request, like KWindowSystem does
+void lowerWindow(WId wid)
+{
+    if (rootInfo().isSupported(NET::WM2RestackWindow))
+        rootInfo().restackRequest(wid, NET::FromTool, None, Below, CurrentTime);
+    else
+        XLowerWindow(display(), wid);
+}
+void raiseWindow(WId wid)
+{
+    if (rootInfo().isSupported(NET::WM2RestackWindow))
+        rootInfo().restackRequest(wid, NET::FromTool, None, Above, CurrentTime);
+    else
+        XRaiseWindow(display(), wid);
+}
+void minimizeWindow(WId wid) { XIconifyWindow(display(), wid, DefaultScreen(display())); }
+void unminimizeWindow(WId wid) { XMapWindow(display(), wid); }
+void demandAttention(WId wid, bool set)
+{
+    NETWinInfo(display(), wid, rootWindow(), NET::WMState).setState(set ? NET::DemandsAttention : 0, NET::DemandsAttention);
+}
+}
+
+// for _NET_MOVERESIZE_WINDOW
+enum Gravity { Original = 0, NorthWest, North, NorthEast, West, Center, East, SouthWest, South, SouthEast, Static };
+enum MoveResizeFlags { XPresent = 1<<8, YPresent = 1<<9, WidthPresent = 1<<10, HeightPresent = 1<<11, FromTool = 1<<13 };
+
+// like QDesktopWidget::availableGeometry(int) for every screen, the part of the work area on it
+QList<QRect> availableScreens()
+{
+    QList<QRect> screens;
+    int count = 0;
+    if (XineramaScreenInfo *info = XineramaIsActive(display()) ? XineramaQueryScreens(display(), &count) : 0) {
+        for (int i = 0; i < count; ++i)
+            screens << QRect(info[i].x_org, info[i].y_org, info[i].width, info[i].height);
+        XFree(info);
+    }
+    if (screens.isEmpty())
+        screens << QRect(0, 0, DisplayWidth(display(), DefaultScreen(display())), DisplayHeight(display(), DefaultScreen(display())));
+    const NETRect area = rootInfo().workArea(rootInfo().currentDesktop());
+    const QRect workArea(area.pos.x, area.pos.y, area.size.width, area.size.height);
+    for (int i = 0; workArea.isValid() && i < screens.count(); ++i) {
+        if (screens.at(i).intersects(workArea))
+            screens[i] &= workArea;
+    }
+    return screens;
+}
+
+// the index of the screen that contains point, the first one if none does
+int screenAt(const QList<QRect> &screens, const QPoint &point)
+{
+    for (int i = 0; i < screens.count(); ++i) {
+        if (screens.at(i).contains(point))
+            return i;
+    }
+    return 0;
+}
+
+// like QDesktopWidget::availableGeometry(), the work area on the screen that contains point
+QRect availableGeometry(const QPoint &point)
+{
+    const QList<QRect> screens = availableScreens();
+    return screens.at(screenAt(screens, point));
+}
+
 int virtualDesktop(QString deskId)
 {
     bool ok;
     int desk = deskId.toInt(&ok);
     if (!ok) {
         desk = 0;
-        for (int i = 1; i <= KWindowSystem::numberOfDesktops(); ++i) {
-            if (KWindowSystem::desktopName(i) == deskId) {
+        for (int i = 1; i <= WindowSystem::numberOfDesktops(); ++i) {
+            if (WindowSystem::desktopName(i) == deskId) {
                 desk = i;
                 break;
             }
@@ -201,92 +381,937 @@ void setTransient(WId sub, WId main)
         subWindow->setTransientParent(mainWindow);
 #else
     if (main)
-        XSetTransientForHint(QX11Info::display(), sub, main);
+        XSetTransientForHint(display(), sub, main);
     else
-        XDeleteProperty(QX11Info::display(), sub, XA_WM_TRANSIENT_FOR);
+        XDeleteProperty(display(), sub, XA_WM_TRANSIENT_FOR);
 #endif
 }
 
 
+/**
+ * The properties of all managed windows, read at once: every request is sent before the first reply is
+ * waited for, so a snapshot costs three round trips (atoms, client list, properties) no matter how many
+ * windows there are - KWindowInfo asks for each property of each window and waits every time.
+ */
+class WindowSnapshot
+{
+public:
+    enum Property { Name = 1<<0, Class = 1<<1, Type = 1<<2, Desktop = 1<<3, Geometry = 1<<4, State = 1<<5, All = 0x3f };
+    struct Client {
+        explicit Client(WId window = 0) : id(window), type(NET::Unknown), desktop(0), state(0), minimized(false) {}
+        WId id;
+        QString name; // the visible name
+        QByteArray windowClass, windowName; // the class and name parts of WM_CLASS
+        int type; // NET::WindowType
+        int desktop; // like KWindowInfo::desktop()
+        QRect geometry;
+        unsigned long state; // NET::State
+        bool minimized;
+        QString nameWithState() const { return minimized ? '(' + name + ')' : name; } // needs State
+    };
+    WindowSnapshot(int properties);
+    const QList<Client> &clients() const { return m_clients; }
+    // the ids of _NET_CLIENT_LIST_STACKING, bottom to top
+    static QList<WId> stackingOrder();
+    // reads properties[i] of clients[i], sending all requests before waiting for any reply
+    static void read(const QList<Client*> &clients, const QList<int> &properties);
+private:
+    QList<Client> m_clients;
+};
+
+enum Atoms { ClientListStacking = 0, VisibleName, NetName, Utf8String, WindowType, NetDesktop, NetState, WMState, FrameExtents,
+             FirstType, FirstState = FirstType + 16, AtomCount = FirstState + 12 };
+
+static const char *atomNames[AtomCount] = {
+    "_NET_CLIENT_LIST_STACKING", "_NET_WM_VISIBLE_NAME", "_NET_WM_NAME", "UTF8_STRING", "_NET_WM_WINDOW_TYPE",
+    "_NET_WM_DESKTOP", "_NET_WM_STATE", "WM_STATE", "_NET_FRAME_EXTENTS",
+    // in the order of NET::WindowType and wmTypes
+    "_NET_WM_WINDOW_TYPE_NORMAL", "_NET_WM_WINDOW_TYPE_DESKTOP", "_NET_WM_WINDOW_TYPE_DOCK", "_NET_WM_WINDOW_TYPE_TOOLBAR",
+    "_NET_WM_WINDOW_TYPE_MENU", "_NET_WM_WINDOW_TYPE_DIALOG", "_KDE_NET_WM_WINDOW_TYPE_OVERRIDE", "_KDE_NET_WM_WINDOW_TYPE_TOPMENU",
+    "_NET_WM_WINDOW_TYPE_UTILITY", "_NET_WM_WINDOW_TYPE_SPLASH", "_NET_WM_WINDOW_TYPE_DROPDOWN_MENU", "_NET_WM_WINDOW_TYPE_POPUP_MENU",
+    "_NET_WM_WINDOW_TYPE_TOOLTIP", "_NET_WM_WINDOW_TYPE_NOTIFICATION", "_NET_WM_WINDOW_TYPE_COMBO", "_NET_WM_WINDOW_TYPE_DND",
+    // in the order of netStates
+    "_NET_WM_STATE_MODAL", "_NET_WM_STATE_STICKY", "_NET_WM_STATE_MAXIMIZED_VERT", "_NET_WM_STATE_MAXIMIZED_HORZ",
+    "_NET_WM_STATE_SHADED", "_NET_WM_STATE_SKIP_TASKBAR", "_NET_WM_STATE_SKIP_PAGER", "_NET_WM_STATE_HIDDEN",
+    "_NET_WM_STATE_FULLSCREEN", "_NET_WM_STATE_ABOVE", "_NET_WM_STATE_BELOW", "_NET_WM_STATE_DEMANDS_ATTENTION"
+};
+
+static const unsigned long netStates[12] = {
+    NET::Modal, NET::Sticky, NET::MaxVert, NET::MaxHoriz, NET::Shaded, NET::SkipTaskbar, NET::SkipPager, NET::Hidden,
+    NET::FullScreen, NET::KeepAbove, NET::KeepBelow, NET::DemandsAttention
+};
+
+inline xcb_connection_t *xcb() { return XGetXCBConnection(display()); }
+
+static const xcb_atom_t *atoms()
+{
+    static xcb_atom_t atoms[AtomCount] = { XCB_ATOM_NONE };
+    static bool interned = false;
+    if (!interned) {
+        xcb_intern_atom_cookie_t cookies[AtomCount];
+        for (int i = 0; i < AtomCount; ++i)
+            cookies[i] = xcb_intern_atom(xcb(), false, strlen(atomNames[i]), atomNames[i]);
+        for (int i = 0; i < AtomCount; ++i) {
+            if (xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(xcb(), cookies[i], 0)) {
+                atoms[i] = reply->atom;
+                free(reply);
+            }
+        }
+        interned = true;
+    }
+    return atoms;
+}
+
+static xcb_get_property_cookie_t requestProperty(xcb_window_t window, xcb_atom_t property, xcb_atom_t type = XCB_ATOM_ANY)
+{
+    return xcb_get_property(xcb(), false, window, property, type, 0, 0xffff);
+}
+
+// errors (the window is gone by now) are taken here, Xlib would otherwise treat them as fatal
+static QByteArray propertyReply(xcb_get_property_cookie_t cookie)
+{
+    xcb_generic_error_t *error = 0;
+    xcb_get_property_reply_t *reply = xcb_get_property_reply(xcb(), cookie, &error);
+    free(error);
+    if (!reply)
+        return QByteArray();
+    QByteArray value((const char*)xcb_get_property_value(reply), xcb_get_property_value_length(reply));
+    free(reply);
+    return value;
+}
+
+/**
+ * The windows as the server knows them. Everything is read once, after that PropertyNotify and ConfigureNotify
+ * only mark what changed and the next command reads that again, for all changed windows at once.
+ * The active window and the desktops are not in here: Server::x11EventFilter() passes the root window's
+ * PropertyNotify to rootInfo(), a NETRootInfo on the server's connection, not to KWindowSystem.
+ */
+class WindowCache
+{
+public:
+    WindowCache();
+    void event(const XEvent *event);
+    QList<WindowSnapshot::Client> clients();
+private:
+    QList<WId> m_stack;
+    bool m_stackChanged;
+    QHash<WId, WindowSnapshot::Client> m_clients;
+    QHash<WId, int> m_changed; // window -> the WindowSnapshot::Property to read again
+};
+
+static WindowCache *gs_cache = 0; // only in the server
+static const WindowSnapshot *gs_snapshot = 0; // the windows a selector matched, while the command runs for each of them
+
+// the pending replies for one window
+struct Requests {
+    xcb_get_property_cookie_t visibleName, netName, wmName, wmClass, type, transientFor, desktop, state, wmState;
+    xcb_get_geometry_cookie_t geometry;
+    xcb_translate_coordinates_cookie_t position;
+};
+
+QList<WId> WindowSnapshot::stackingOrder()
+{
+    const QByteArray list = propertyReply(requestProperty(rootWindow(), atoms()[ClientListStacking], XCB_ATOM_WINDOW));
+    const xcb_window_t *ids = (const xcb_window_t*)list.constData();
+    QList<WId> stack;
+    for (int i = 0; i < int(list.size() / sizeof(xcb_window_t)); ++i)
+        stack << ids[i];
+    return stack;
+}
 
-WId window(QString string)
+WindowSnapshot::WindowSnapshot(int properties)
+{
+    if (gs_cache) {
+        m_clients = gs_cache->clients();
+        return;
+    }
+    if (gs_snapshot) {
+        m_clients = gs_snapshot->clients();
+        return;
+    }
+    foreach (const WId &wid, stackingOrder())
+        m_clients << Client(wid);
+    QList<Client*> clients;
+    for (int i = 0; i < m_clients.count(); ++i)
+        clients << &m_clients[i];
+    read(clients, QVector<int>(clients.count(), properties).toList());
+}
+
+void WindowSnapshot::read(const QList<Client*> &clients, const QList<int> &properties)
+{
+    const xcb_atom_t *atom = atoms();
+    const xcb_window_t root = rootWindow();
+    const int count = clients.count();
+    QVector<Requests> requests(count);
+    for (int i = 0; i < count; ++i) {
+        Requests &r = requests[i];
+        const xcb_window_t id = clients.at(i)->id;
+        const int p = properties.at(i);
+        if (p & Name) {
+            r.visibleName = requestProperty(id, atom[VisibleName], atom[Utf8String]);
+            r.netName = requestProperty(id, atom[NetName], atom[Utf8String]);
+            r.wmName = requestProperty(id, XCB_ATOM_WM_NAME);
+        }
+        if (p & Class)
+            r.wmClass = requestProperty(id, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING);
+        if (p & Type) {
+            r.type = requestProperty(id, atom[WindowType], XCB_ATOM_ATOM);
+            r.transientFor = requestProperty(id, XCB_ATOM_WM_TRANSIENT_FOR, XCB_ATOM_WINDOW);
+        }
+        if (p & Desktop)
+            r.desktop = requestProperty(id, atom[NetDesktop], XCB_ATOM_CARDINAL);
+        if (p & State) {
+            r.state = requestProperty(id, atom[NetState], XCB_ATOM_ATOM);
+            r.wmState = requestProperty(id, atom[WMState]);
+        }
+        if (p & Geometry) {
+            r.geometry = xcb_get_geometry(xcb(), id);
+            r.position = xcb_translate_coordinates(xcb(), id, root, 0, 0);
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        const Requests &r = requests[i];
+        Client &client = *clients.at(i);
+        const int p = properties.at(i);
+        if (p & Name) {
+            const QByteArray visibleName = propertyReply(r.visibleName), netName = propertyReply(r.netName);
+            const QByteArray wmName = propertyReply(r.wmName);
+            client.name = !visibleName.isEmpty() ? QString::fromUtf8(visibleName) :
+                          !netName.isEmpty() ? QString::fromUtf8(netName) : QString::fromLocal8Bit(wmName);
+        }
+        if (p & Class) {
+            const QByteArray wmClass = propertyReply(r.wmClass); // "name\0class\0"
+            const int split = wmClass.indexOf('\0');
+            client.windowName = wmClass.left(split);
+            client.windowClass = split < 0 ? QByteArray() : wmClass.mid(split + 1, wmClass.indexOf('\0', split + 1) - split - 1);
+        }
+        if (p & Type) {
+            client.type = NET::Unknown;
+            const QByteArray types = propertyReply(r.type);
+            const xcb_atom_t *type = (const xcb_atom_t*)types.constData();
+            for (int j = 0; j < int(types.size() / sizeof(xcb_atom_t)) && client.type == NET::Unknown; ++j) {
+                for (int k = 0; k < 16; ++k) {
+                    if (type[j] == atom[FirstType + k]) {
+                        client.type = k;
+                        break;
+                    }
+                }
+            }
+            // without _NET_WM_WINDOW_TYPE a transient is a Dialog and everything else Normal, as the EWMH says
+            const bool transient = propertyReply(r.transientFor).size() >= 4;
+            if (client.type == NET::Unknown)
+                client.type = transient ? NET::Dialog : NET::Normal;
+        }
+        if (p & Desktop) {
+            client.desktop = 0;
+            const QByteArray desktop = propertyReply(r.desktop);
+            if (desktop.size() >= 4) {
+                const quint32 d = *(const quint32*)desktop.constData();
+                client.desktop = d == 0xffffffff ? int(NET::OnAllDesktops) : int(d + 1);
+            }
+        }
+        if (p & State) {
+            client.state = 0;
+            const QByteArray states = propertyReply(r.state);
+            const xcb_atom_t *state = (const xcb_atom_t*)states.constData();
+            for (int j = 0; j < int(states.size() / sizeof(xcb_atom_t)); ++j) {
+                for (int k = 0; k < 12; ++k) {
+                    if (state[j] == atom[FirstState + k])
+                        client.state |= netStates[k];
+                }
+            }
+            const QByteArray wmState = propertyReply(r.wmState);
+            const bool iconic = wmState.size() >= 4 && *(const quint32*)wmState.constData() == 3; // IconicState
+            // like KWindowInfo::isMinimized(), shaded windows are iconic too
+            client.minimized = iconic && ((client.state & NET::Hidden) || !(client.state & NET::Shaded));
+        }
+        if (p & Geometry) {
+            xcb_generic_error_t *error = 0;
+            xcb_get_geometry_reply_t *geometry = xcb_get_geometry_reply(xcb(), r.geometry, &error);
+            free(error);
+            error = 0;
+            xcb_translate_coordinates_reply_t *position = xcb_translate_coordinates_reply(xcb(), r.position, &error);
+            free(error);
+            client.geometry = (geometry && position) ?
+                QRect(position->dst_x, position->dst_y, geometry->width, geometry->height) : QRect();
+            free(geometry);
+            free(position);
+        }
+    }
+}
+
+WindowCache::WindowCache() : m_stackChanged(true)
+{
+    // Qt listens on the root window already, don't take that away
+    XWindowAttributes attributes;
+    XGetWindowAttributes(display(), rootWindow(), &attributes);
+    XSelectInput(display(), rootWindow(), attributes.your_event_mask | PropertyChangeMask);
+}
+
+void WindowCache::event(const XEvent *event)
+{
+    const xcb_atom_t *atom = atoms();
+    if (event->type == PropertyNotify) {
+        const Atom property = event->xproperty.atom;
+        if (event->xproperty.window == rootWindow()) {
+            if (property == atom[ClientListStacking])
+                m_stackChanged = true;
+            return;
+        }
+        int changed = 0;
+        if (property == atom[VisibleName] || property == atom[NetName] || property == XA_WM_NAME)
+            changed = WindowSnapshot::Name;
+        else if (property == XA_WM_CLASS)
+            changed = WindowSnapshot::Class;
+        else if (property == atom[WindowType] || property == XA_WM_TRANSIENT_FOR)
+            changed = WindowSnapshot::Type;
+        else if (property == atom[NetDesktop])
+            changed = WindowSnapshot::Desktop;
+        else if (property == atom[NetState] || property == atom[WMState])
+            changed = WindowSnapshot::State;
+        if (changed && m_clients.contains(event->xproperty.window))
+            m_changed[event->xproperty.window] |= changed;
+    } else if (event->type == ConfigureNotify) {
+        // the WM sends a synthetic one when it moves the frame
+        if (m_clients.contains(event->xconfigure.window))
+            m_changed[event->xconfigure.window] |= WindowSnapshot::Geometry;
+    } else if (event->type == DestroyNotify) {
+        if (m_clients.contains(event->xdestroywindow.window))
+            m_stackChanged = true;
+    }
+}
+
+QList<WindowSnapshot::Client> WindowCache::clients()
+{
+    if (m_stackChanged) {
+        m_stackChanged = false;
+        m_stack = WindowSnapshot::stackingOrder();
+        QSet<WId> gone = m_clients.keys().toSet();
+        foreach (const WId &wid, m_stack) {
+            if (gone.remove(wid))
+                continue;
+            // listen before reading, so no change gets lost in between
+            const uint32_t mask = XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+            xcb_change_window_attributes(xcb(), wid, XCB_CW_EVENT_MASK, &mask);
+            m_clients.insert(wid, WindowSnapshot::Client(wid));
+            m_changed.insert(wid, WindowSnapshot::All);
+        }
+        foreach (const WId &wid, gone) {
+            m_clients.remove(wid);
+            m_changed.remove(wid);
+        }
+    }
+    if (!m_changed.isEmpty()) {
+        QList<WindowSnapshot::Client*> changed;
+        QList<int> properties;
+        for (QHash<WId, int>::const_iterator it = m_changed.constBegin(); it != m_changed.constEnd(); ++it) {
+            changed << &m_clients[it.key()];
+            properties << it.value();
+        }
+        WindowSnapshot::read(changed, properties);
+        m_changed.clear();
+    }
+    QList<WindowSnapshot::Client> clients;
+    foreach (const WId &wid, m_stack)
+        clients << m_clients.value(wid);
+    return clients;
+}
+
+static const char *wmTypes[16] = {
+    "Normal", "Desktop", "Dock", "Toolbar", "Menu", "Dialog", "Override", "TopMenu",
+    "Utility", "Splash", "DropdownMenu", "PopupMenu", "Tooltip", "Notification", "ComboBox", "DNDIcon"
+};
+
+const char *wmType(int i)
+{
+    if (i < 0 || i > 15)
+        return "Unknown";
+    return wmTypes[i];
+}
+
+static const char *stateNames[12] = {
+    "modal", "sticky", "maximized_vertically", "maximized_horizontally", "shaded", "skiptaskbar", "skippager", "hidden",
+    "fullscreen", "keepabove", "keepbelow", "demandsattention"
+};
+
+/**
+ * A window selector like "class=firefox,desktop=3,title~=^Mozilla": every criterion must match.
+ * = compares case insensitive, != is its negation, ~= matches a regular expression. "\," is a comma in a value.
+ */
+struct Criterion {
+    enum Operator { Equal, NotEqual, Match };
+    QString key;
+    Operator op;
+    QString value;
+    QRegExp regExp;
+};
+
+static const char *selectorKeys[7] = { "id", "class", "name", "title", "type", "desktop", "state" };
+
+QStringList splitSelector(const QString &string)
+{
+    QStringList parts;
+    QString part;
+    for (int i = 0; i < string.length(); ++i) {
+        if (string.at(i) == '\\' && i + 1 < string.length() && string.at(i + 1) == ',') {
+            part += string.at(++i);
+        } else if (string.at(i) == ',') {
+            parts << part;
+            part.clear();
+        } else {
+            part += string.at(i);
+        }
+    }
+    return parts << part;
+}
+
+// the key of one criterion or an empty string if it is none
+QString selectorKey(const QString &part, Criterion::Operator *op = 0, int *valueStart = 0)
+{
+    const int eq = part.indexOf('=');
+    if (eq < 1)
+        return QString();
+    int keyEnd = eq;
+    Criterion::Operator o = Criterion::Equal;
+    if (part.at(eq - 1) == '~' || part.at(eq - 1) == '!') {
+        o = part.at(eq - 1) == '~' ? Criterion::Match : Criterion::NotEqual;
+        --keyEnd;
+    }
+    const QString key = part.left(keyEnd).trimmed().toLower();
+    for (int i = 0; i < 7; ++i) {
+        if (key == selectorKeys[i]) {
+            if (op)
+                *op = o;
+            if (valueStart)
+                *valueStart = eq + 1;
+            return key;
+        }
+    }
+    return QString();
+}
+
+// a window name can contain '=', it's only a selector if it starts with a known key
+bool isSelector(const QString &string)
+{
+    return !selectorKey(splitSelector(string).first()).isEmpty();
+}
+
+// prints the help and returns false if a part is no valid criterion
+bool parseSelector(const QString &string, QList<Criterion> *criteria)
+{
+    foreach (const QString &part, splitSelector(string)) {
+        Criterion criterion;
+        int valueStart;
+        criterion.key = selectorKey(part, &criterion.op, &valueStart);
+        if (criterion.key.isEmpty()) {
+            printHelp("selector", part);
+            return false;
+        }
+        criterion.value = part.mid(valueStart);
+        if (criterion.op == Criterion::Match) {
+            criterion.regExp = QRegExp(criterion.value, Qt::CaseInsensitive);
+            if (!criterion.regExp.isValid()) {
+                printHelp("selector", part);
+                return false;
+            }
+        }
+        *criteria << criterion;
+    }
+    return true;
+}
+
+bool matches(const Criterion &criterion, const WindowSnapshot::Client &client)
+{
+    QStringList values; // the criterion matches if one of them does
+    if (criterion.key == "desktop" && criterion.op != Criterion::Match) {
+        int desktop = criterion.value.toLower() == "all" ? int(NET::OnAllDesktops) :
+                      criterion.value.toLower() == "current" ? WindowSystem::currentDesktop() : virtualDesktop(criterion.value);
+        // a window on all desktops is on every single one
+        const bool on = client.desktop == desktop || (desktop > 0 && client.desktop == NET::OnAllDesktops);
+        return on == (criterion.op == Criterion::Equal);
+    } else if (criterion.key == "desktop") {
+        values << toString(client.desktop);
+    } else if (criterion.key == "id") {
+        values << toString(client.id) << "0x" + QString::number(client.id, 16);
+    } else if (criterion.key == "class") {
+        values << QString::fromLocal8Bit(client.windowClass) << QString::fromLocal8Bit(client.windowName);
+    } else if (criterion.key == "name") {
+        values << QString::fromLocal8Bit(client.windowName);
+    } else if (criterion.key == "title") {
+        values << client.name;
+    } else if (criterion.key == "type") {
+        values << wmType(client.type);
+    } else if (criterion.key == "state") {
+        for (int i = 0; i < 12; ++i) {
+            if (client.state & netStates[i])
+                values << stateNames[i];
+        }
+        if (client.minimized)
+            values << "minimized";
+        if ((client.state & NET::Max) == NET::Max)
+            values << "maximized";
+    }
+    bool found = false;
+    foreach (const QString &value, values) {
+        if (criterion.op == Criterion::Match)
+            found = criterion.regExp.indexIn(value) > -1;
+        else
+            found = !value.compare(criterion.value, Qt::CaseInsensitive);
+        if (found)
+            break;
+    }
+    return found == (criterion.op != Criterion::NotEqual);
+}
+
+// the matching windows from one snapshot, bottom to top
+QList<WindowSnapshot::Client> selectClients(const QList<Criterion> &criteria)
+{
+    QList<WindowSnapshot::Client> clients;
+    foreach (const WindowSnapshot::Client &client, WindowSnapshot(WindowSnapshot::All).clients()) {
+        bool match = true;
+        for (int i = 0; i < criteria.count() && match; ++i)
+            match = matches(criteria.at(i), client);
+        if (match)
+            clients << client;
+    }
+    return clients;
+}
+
+bool findWindow(QString string, WId *result);
+
+static QHash<QString, WId> gs_resolved; // a batch looks every window up once, cleared when it's done
+
+// prints the help and returns false if there is no such window
+bool window(QString string, WId *result)
+{
+    if (gs_batch && string != "active" && gs_resolved.contains(string)) {
+        *result = gs_resolved.value(string);
+        return true;
+    }
+    if (!findWindow(string, result))
+        return false;
+    if (gs_batch)
+        gs_resolved.insert(string, *result);
+    return true;
+}
+
+// from the snapshot of the server or a batch if there is one
+bool hasWId(WId wid)
+{
+    foreach (const WindowSnapshot::Client &client, WindowSnapshot(0).clients()) {
+        if (client.id == wid)
+            return true;
+    }
+    return false;
+}
+
+bool findWindow(QString string, WId *result)
 {
     bool ok;
     WId wid = string.toUInt(&ok);
     if (!ok) {
         if ((ok = (string == "active"))) {
-            return KWindowSystem::activeWindow();
+            *result = WindowSystem::activeWindow();
+            return true;
         } else if ((ok = (string == "none"))) {
-            return 0;
+            *result = 0;
+            return true;
         } else if ((ok = (string == "pick"))) {
-            return WindowPicker().pick();
+            if (gs_noPick) {
+                printHelp("nopick");
+                return false;
+            }
+            *result = pickWindow();
+            return true;
+        } else if (isSelector(string)) { // the first match, commands run for all of them
+            QList<Criterion> criteria;
+            if (!parseSelector(string, &criteria))
+                return false;
+            const QList<WindowSnapshot::Client> clients = selectClients(criteria);
+            if (!clients.isEmpty()) {
+                *result = clients.first().id;
+                return true;
+            }
         } else {
-            const QList<WId> stack = KWindowSystem::stackingOrder();
+            const WindowSnapshot snapshot(WindowSnapshot::Name|WindowSnapshot::Class);
             QList<WId> className, title, classPartial, classNamePartial, titlePartial;
-            foreach (const WId &wid, stack) {
-                KWindowInfo info(wid, NET::WMVisibleName, NET::WM2WindowClass);
-                if (!string.compare(info.windowClassClass(), Qt::CaseInsensitive))
-                    return wid; // matches class - very good
-                if (!string.compare(info.windowClassName(), Qt::CaseInsensitive))
+            foreach (const WindowSnapshot::Client &client, snapshot.clients()) {
+                const WId wid = client.id;
+                if (!string.compare(client.windowClass, Qt::CaseInsensitive)) {
+                    *result = wid; // matches class - very good
+                    return true;
+                }
+                if (!string.compare(client.windowName, Qt::CaseInsensitive))
                     className << wid;
-                else if (!string.compare(info.visibleName(), Qt::CaseInsensitive))
+                else if (!string.compare(client.name, Qt::CaseInsensitive))
                     title << wid;
-                else if (info.windowClassClass().contains(string.toLocal8Bit()))
+                else if (client.windowClass.contains(string.toLocal8Bit()))
                     classPartial << wid;
-                else if (info.windowClassName().contains(string.toLocal8Bit()))
+                else if (client.windowName.contains(string.toLocal8Bit()))
                     classNamePartial << wid;
-                else if (info.visibleName().contains(string.toLocal8Bit()))
+                else if (client.name.contains(string.toLocal8Bit()))
                     titlePartial << wid;
             }
-            if (!className.isEmpty())
-                return className.first();
-            if (!title.isEmpty())
-                return title.first();
-            if (!classPartial.isEmpty())
-                return classPartial.first();
-            if (!classNamePartial.isEmpty())
-                return classNamePartial.first();
-            if (!titlePartial.isEmpty())
-                return titlePartial.first();
-        }
-    }
-    if (ok && (!wid || KWindowSystem::hasWId(wid)))
-        return wid;
+            if (!className.isEmpty()) {
+                *result = className.first();
+                return true;
+            }
+            if (!title.isEmpty()) {
+                *result = title.first();
+                return true;
+            }
+            if (!classPartial.isEmpty()) {
+                *result = classPartial.first();
+                return true;
+            }
+            if (!classNamePartial.isEmpty()) {
+                *result = classNamePartial.first();
+                return true;
+            }
+            if (!titlePartial.isEmpty()) {
+                *result = titlePartial.first();
+                return true;
+            }
+        }
+    }
+    if (ok && (!wid || hasWId(wid))) {
+        *result = wid;
+        return true;
+    }
     printHelp("falsewindow", string);
-    return 0; // for gcc - printHelp will exit(1)
+    return false;
 }
 
-static const char *wmTypes[16] = {
-    "Normal", "Desktop", "Dock", "Toolbar", "Menu", "Dialog", "Override", "TopMenu",
-    "Utility", "Splash", "DropdownMenu", "PopupMenu", "Tooltip", "Notification", "ComboBox", "DNDIcon"
+// the fields of list
+QString toString(const WindowSnapshot::Client &client)
+{
+    return toString(client.id) + " | " + client.nameWithState() + " | " + QString::fromLocal8Bit(client.windowClass) + " | " +
+           QString::fromLocal8Bit(client.windowName) + " | " + wmType(client.type) + " | " + toString(client.desktop) + " | " +
+           toString(client.geometry);
+}
+
+QString toJson(const QString &string)
+{
+    QString ret = "\"";
+    foreach (const QChar &c, string) {
+        if (c == '"' || c == '\\')
+            ret += QString('\\') + c;
+        else if (c == '\n')
+            ret += "\\n";
+        else if (c.unicode() < 0x20)
+            ret += QString("\\u%1").arg(c.unicode(), 4, 16, QChar('0'));
+        else
+            ret += c;
+    }
+    return ret + '"';
+}
+
+// the fields of list as JSON members
+QString toJson(const WindowSnapshot::Client &client)
+{
+    QStringList states;
+    for (int i = 0; i < 12; ++i) {
+        if (client.state & netStates[i])
+            states << toJson(stateNames[i]);
+    }
+    if (client.minimized)
+        states << toJson("minimized");
+    const QRect &g = client.geometry;
+    return "\"id\":" + toString(client.id) + ",\"name\":" + toJson(client.name) +
+           ",\"class\":" + toJson(QString::fromLocal8Bit(client.windowClass)) + ",\"classname\":" + toJson(QString::fromLocal8Bit(client.windowName)) +
+           ",\"type\":" + toJson(wmType(client.type)) + ",\"desktop\":" + toString(client.desktop) +
+           QString(",\"geometry\":{\"x\":%1,\"y\":%2,\"width\":%3,\"height\":%4}").arg(g.x()).arg(g.y()).arg(g.width()).arg(g.height()) +
+           ",\"states\":[" + states.join(",") + "]";
+}
+
+static const char *watchEvents[10] = {
+    "active", "mapped", "unmapped", "name", "desktop", "state", "geometry", "currentdesktop", "desktopcount", "desktopnames"
 };
 
-const char *wmType(int i)
+class EventPrinter
 {
-    if (i < 0 || i > 15)
-        return "Unknown";
-    return wmTypes[i];
+public:
+    EventPrinter(const QSet<QString> &events, bool json) : m_events(events), m_json(json) {}
+    void print(const char *event, const WindowSnapshot::Client &client) {
+        if (wanted(event))
+            line(event, m_json ? toJson(client) : toString(client));
+    }
+    void print(const char *event, const QString &text, const QString &json) {
+        if (wanted(event))
+            line(event, m_json ? json : text);
+    }
+private:
+    bool wanted(const char *event) const { return m_events.isEmpty() || m_events.contains(event); }
+    void line(const char *event, const QString &fields) {
+        if (m_json)
+            out() << "{\"event\":\"" << event << "\"," << CHAR(fields) << "}" << std::endl;
+        else
+            out() << event << " | " << CHAR(fields) << std::endl;
+    }
+    QSet<QString> m_events;
+    bool m_json;
+};
+
+QStringList desktopNames()
+{
+    QStringList names;
+    for (int i = 1; i <= WindowSystem::numberOfDesktops(); ++i)
+        names << WindowSystem::desktopName(i);
+    return names;
 }
 
-int main(int argc, char **argv)
+/**
+ * Prints the changes as they happen. The events are only marked in the WindowCache and compared with the
+ * last state once there are no more pending, so a window that is moved around produces a line per batch
+ * of events, not per event.
+ */
+int watch(const QStringList &args)
+{
+    bool json = false;
+    QSet<QString> events;
+    for (int i = 2; i < args.count(); ++i) {
+        if (args.at(i) == "--json") {
+            json = true;
+            continue;
+        }
+        foreach (const QString &event, args.at(i).split(',', QString::SkipEmptyParts)) {
+            bool known = false;
+            for (int j = 0; j < 10 && !known; ++j)
+                known = event == watchEvents[j];
+            if (!known)
+                return printHelp("watch", event);
+            events << event;
+        }
+    }
+    EventPrinter printer(events, json);
+
+    WindowCache cache;
+    QHash<WId, WindowSnapshot::Client> windows;
+    foreach (const WindowSnapshot::Client &client, cache.clients())
+        windows.insert(client.id, client);
+    NETRootInfo &root = rootInfo();
+    WId active = root.activeWindow();
+    int current = root.currentDesktop(), count = root.numberOfDesktops();
+    QStringList names = desktopNames();
+
+    XEvent event;
+    for (;;) {
+        XNextEvent(display(), &event);
+        cache.event(&event);
+        if (event.xany.window == rootWindow())
+            root.event(&event);
+        if (XPending(display()))
+            continue;
+
+        QHash<WId, WindowSnapshot::Client> now;
+        foreach (const WindowSnapshot::Client &client, cache.clients()) {
+            now.insert(client.id, client);
+            const QHash<WId, WindowSnapshot::Client>::const_iterator it = windows.constFind(client.id);
+            if (it == windows.constEnd()) {
+                printer.print("mapped", client);
+                continue;
+            }
+            if (it->name != client.name)
+                printer.print("name", client);
+            if (it->desktop != client.desktop)
+                printer.print("desktop", client);
+            if (it->state != client.state || it->minimized != client.minimized)
+                printer.print("state", client);
+            if (it->geometry != client.geometry)
+                printer.print("geometry", client);
+        }
+        foreach (const WindowSnapshot::Client &client, windows) {
+            if (!now.contains(client.id))
+                printer.print("unmapped", client);
+        }
+        windows = now;
+
+        if (root.activeWindow() != active) {
+            active = root.activeWindow();
+            printer.print("active", now.value(active, WindowSnapshot::Client(active)));
+        }
+        if (root.currentDesktop() != current) {
+            current = root.currentDesktop();
+            printer.print("currentdesktop", toString(current), "\"desktop\":" + toString(current));
+        }
+        if (root.numberOfDesktops() != count) {
+            count = root.numberOfDesktops();
+            printer.print("desktopcount", toString(count), "\"count\":" + toString(count));
+        }
+        const QStringList newNames = desktopNames();
+        if (newNames != names) {
+            names = newNames;
+            QStringList text, list;
+            for (int i = 0; i < names.count(); ++i) {
+                text << toString(i + 1) + ": " + names.at(i);
+                list << toJson(names.at(i));
+            }
+            printer.print("desktopnames", text.join(" | "), "\"names\":[" + list.join(",") + "]");
+        }
+    }
+    return 0;
+}
+
+int run(const QStringList &args, bool flush = true);
+
+// runs the command once for every window the selector args[index] matches, the requests are sent together
+int forEachWindow(const QStringList &args, int index, bool flush)
+{
+    QList<Criterion> criteria;
+    if (!parseSelector(args.at(index), &criteria))
+        return 1;
+    // so the commands find the windows in the same snapshot, the server and a batch have theirs
+    const WindowSnapshot *own = gs_cache || gs_snapshot ? 0 : new WindowSnapshot(WindowSnapshot::All);
+    if (own)
+        gs_snapshot = own;
+    const QList<WindowSnapshot::Client> windows = selectClients(criteria);
+    int ret = 0;
+    foreach (const WindowSnapshot::Client &client, windows) {
+        QStringList windowArgs = args;
+        windowArgs[index] = toString(client.id);
+        if (run(windowArgs, false))
+            ret = 1;
+    }
+    if (own) {
+        gs_snapshot = 0;
+        delete own;
+    }
+    if (windows.isEmpty())
+        return printHelp("falsewindow", args.at(index));
+    if (flush)
+        XFlush(display());
+    return ret;
+}
+
+static const char *tileLayouts[4] = { "grid", "columns", "master-stack", "cascade" };
+
+// the column-th of columns and row-th of rows parts of area, rounded so they leave no gaps
+QRect cell(const QRect &area, int column, int columns, int row, int rows)
+{
+    const int left = area.x() + area.width() * column / columns, right = area.x() + area.width() * (column + 1) / columns;
+    const int top = area.y() + area.height() * row / rows, bottom = area.y() + area.height() * (row + 1) / rows;
+    return QRect(left, top, right - left, bottom - top);
+}
+
+// the frames of count windows in area, the first one is the topmost window
+QList<QRect> tileLayout(const QString &layout, const QRect &area, int count)
+{
+    QList<QRect> rects;
+    if (layout == "grid") {
+        int columns = 1;
+        while (columns * columns < count)
+            ++columns;
+        const int rows = (count + columns - 1) / columns;
+        for (int i = 0; i < count; ++i) {
+            const int row = i / columns;
+            const int inRow = (row == rows - 1) ? count - row * columns : columns; // the last row shares the width
+            rects << cell(area, i % columns, inRow, row, rows);
+        }
+    } else if (layout == "columns") {
+        for (int i = 0; i < count; ++i)
+            rects << cell(area, i, count, 0, 1);
+    } else if (layout == "master-stack") {
+        if (count == 1)
+            rects << area;
+        else
+            rects << cell(area, 0, 2, 0, 1);
+        const QRect stack = cell(area, 1, 2, 0, 1);
+        for (int i = 1; i < count; ++i)
+            rects << cell(stack, 0, 1, i - 1, count - 1);
+    } else if (layout == "cascade") {
+        const int step = 32;
+        const QSize size(area.width() * 2 / 3, area.height() * 2 / 3);
+        const int steps = qMax(1, qMin(area.width() - size.width(), area.height() - size.height()) / step + 1);
+        // the topmost window goes on top of the cascade
+        for (int i = count - 1; i > -1; --i)
+            rects << QRect(area.topLeft() + QPoint(step, step) * (i % steps), size);
+    }
+    return rects;
+}
+
+/**
+ * Arranges the windows on every screen in its available area. The frame extents of all windows are read at
+ * once and the move/resize requests are flushed together, so the window manager gets them in one go.
+ */
+int tile(const QStringList &args, bool flush)
 {
-    if (argc < 2) {
-        printHelp();
+    const QString layout = args.value(2);
+    bool known = false;
+    for (int i = 0; i < 4 && !known; ++i)
+        known = layout == tileLayouts[i];
+    if (!known)
+        return printHelp("tile", layout);
+
+    QList<WindowSnapshot::Client> clients;
+    const QString selector = args.count() > 3 ? args.at(3) : "type=Normal,desktop=current,state!=minimized";
+    if (isSelector(selector)) {
+        QList<Criterion> criteria;
+        if (!parseSelector(selector, &criteria))
+            return 1;
+        clients = selectClients(criteria);
+    } else {
+        WId wid;
+        if (!window(selector, &wid))
+            return 1;
+        clients << WindowSnapshot::Client(wid);
+        WindowSnapshot::read(QList<WindowSnapshot::Client*>() << &clients.first(), QList<int>() << WindowSnapshot::All);
+    }
+    if (clients.isEmpty())
+        return printHelp("falsewindow", selector);
+
+    const xcb_atom_t *atom = atoms();
+    QVector<xcb_get_property_cookie_t> cookies;
+    foreach (const WindowSnapshot::Client &client, clients)
+        cookies << requestProperty(client.id, atom[FrameExtents], XCB_ATOM_CARDINAL);
+    QVector<QMargins> frames;
+    for (int i = 0; i < cookies.count(); ++i) {
+        const QByteArray extents = propertyReply(cookies.at(i)); // left, right, top, bottom
+        const quint32 *e = (const quint32*)extents.constData();
+        frames << (extents.size() >= 16 ? QMargins(e[0], e[2], e[1], e[3]) : QMargins());
     }
 
-    QApplication a(argc, argv); // required to talk to the X11 server
+    const QList<QRect> screens = availableScreens();
+    QVector<QList<int> > windows(screens.count()); // per screen, topmost first
+    for (int i = clients.count() - 1; i > -1; --i)
+        windows[screenAt(screens, clients.at(i).geometry.center())] << i;
+    for (int s = 0; s < screens.count(); ++s) {
+        const QList<QRect> rects = tileLayout(layout, screens.at(s), windows.at(s).count());
+        for (int i = 0; i < rects.count(); ++i) {
+            const WindowSnapshot::Client &client = clients.at(windows.at(s).at(i));
+            const QMargins &frame = frames.at(windows.at(s).at(i));
+            if (client.state & (NET::Max|NET::FullScreen)) // they would not move
+                NETWinInfo(display(), client.id, rootWindow(), NET::WMState).setState(0, NET::Max|NET::FullScreen);
+            // with NorthWest gravity the position is the one of the frame, the size the one of the window
+            const QRect &r = rects.at(i);
+            rootInfo().moveResizeWindowRequest(client.id, NorthWest|XPresent|YPresent|WidthPresent|HeightPresent|FromTool,
+                                               r.x(), r.y(), r.width() - frame.left() - frame.right(),
+                                               r.height() - frame.top() - frame.bottom());
+        }
+    }
+    if (flush)
+        XFlush(display());
+    return 0;
+}
 
-    QString command = QString::fromLocal8Bit(argv[1]);
+// args are like argv, returns the exit code, flush is false where the requests are sent together later
+int run(const QStringList &args, bool flush)
+{
+    const int argc = args.count();
+    QString command = args.at(1);
     INFO("active", activeWindow)
     INFO("isComposited", compositingActive)
 
+    if (command == "watch")
+        return watch(args);
+
+    if (command == "tile")
+        return tile(args, flush);
+
     if (command == "list") {
-        const QList<WId> stack = KWindowSystem::stackingOrder();
-        foreach (const WId &wid, stack) {
-            KWindowInfo info(wid, NET::WMWindowType|NET::WMVisibleName|NET::WMDesktop|NET::WMGeometry|NET::WMState|NET::XAWMState, NET::WM2WindowClass);
-            std::cout << CHAR(toString(wid)) << " | " << CHAR(info.visibleNameWithState()) << " | " <<
-                         info.windowClassClass().data() << " | " << info.windowClassName().data() << " | " <<
-                         wmType(info.windowType(NET::AllTypesMask)) << " | " << CHAR(toString(info.desktop())) << " | "  << CHAR(toString(info.geometry())) << std::endl;
+        const WindowSnapshot snapshot(WindowSnapshot::All);
+        foreach (const WindowSnapshot::Client &client, snapshot.clients()) {
+            out() << CHAR(toString(client)) << std::endl;
         }
         FINISH;
     }
@@ -298,83 +1323,88 @@ int main(int argc, char **argv)
     WIN_FUNC("unminimize", unminimizeWindow)
     if (command == "close") {
         REQUIRE_WID;
-        NETRootInfo(QX11Info::display(), NET::CloseWindow).closeWindowRequest(wid);
-        a.processEvents();
+        NETRootInfo(display(), NET::CloseWindow).closeWindowRequest(wid);
         FINISH;
     }
 
     if (command == "id") {
-        WId wid = (argc > 2 && QString::fromLocal8Bit(argv[2]) == "active") ?
-                    KWindowSystem::activeWindow() : WindowPicker().pick();
-        std::cout << CHAR(toString(wid)) << std::endl;
+        if (gs_noPick && !(argc > 2 && args.at(2) == "active"))
+            return printHelp("nopick");
+        WId wid = (argc > 2 && args.at(2) == "active") ?
+                    WindowSystem::activeWindow() : pickWindow();
+        out() << CHAR(toString(wid)) << std::endl;
         FINISH;
     }
 
     bool set = false, toggle = false;
     if ((set = (command == "set")) || (toggle = (command == "toggle")) || (command == "unset")) {
         if (argc < 4)
-            printHelp("set");
+            return printHelp("set");
 
         REQUIRE_WID;
 
-        command = QString::fromLocal8Bit(argv[3]);
+        command = args.at(3);
         if (set && command == "desktop") {
             if (argc < 5)
-                printHelp("setdesktop");
-            command = QString::fromLocal8Bit(argv[4]);
+                return printHelp("setdesktop");
+            command = args.at(4);
             if (command.toLower() == "all") {
-                KWindowSystem::setOnAllDesktops(wid, set);
+                WindowSystem::setOnAllDesktops(wid, set);
                 FINISH;
             }
             const int desk = virtualDesktop(command);
-            if (desk < 1 || desk > KWindowSystem::numberOfDesktops())
-                printHelp("falsedesk", command);
-            KWindowSystem::setOnDesktop(wid, desk);
+            if (desk < 1 || desk > WindowSystem::numberOfDesktops())
+                return printHelp("falsedesk", command);
+            WindowSystem::setOnDesktop(wid, desk);
             FINISH;
         }
 
         if (set && command == "geometry") {
             if (argc < 5)
-                printHelp("setgeometry");
+                return printHelp("setgeometry");
             int x,y;
             unsigned int w,h;
-            int parsed = XParseGeometry(argv[4], &x, &y, &w, &h);
+            int parsed = XParseGeometry(args.at(4).toLocal8Bit().constData(), &x, &y, &w, &h);
             if (!parsed)
-                printHelp("setgeometry");
+                return printHelp("setgeometry");
 
-            const QRect geometry = KWindowInfo(wid, NET::WMGeometry).geometry();
-            const QRect area = a.desktop()->availableGeometry(geometry.center());
-            enum Gravity { Original = 0, NorthWest, North, NorthEast, West, Center, East, SouthWest, South, SouthEast, Static };
-            int flags = 1 << 13; // "from tool"
+            WindowSnapshot::Client client(wid);
+            WindowSnapshot::read(QList<WindowSnapshot::Client*>() << &client, QList<int>() << WindowSnapshot::Geometry);
+            const QRect geometry = client.geometry;
+            const QRect area = availableGeometry(geometry.center());
+            int flags = FromTool;
             int gravity = Center;
-            (parsed & WidthValue) ? flags |= 1<<10 : w = geometry.width();
-            (parsed & HeightValue) ? flags |= 1<<11 : h = geometry.height();
+            (parsed & WidthValue) ? flags |= WidthPresent : w = geometry.width();
+            (parsed & HeightValue) ? flags |= HeightPresent : h = geometry.height();
             if (parsed & XValue) {
                 gravity = West;
-                flags |= 1<<8;
+                flags |= XPresent;
                 if (parsed & XNegative)
                     x = area.right() - (w + x);
             }
             if (parsed & YValue) {
-                gravity == West ? NorthWest : North;
-                flags |= 1<<9;
+                gravity = (gravity == West) ? NorthWest : North;
+                flags |= YPresent;
                 if (parsed & YNegative)
                     y = area.bottom() - (h + y);
             }
             flags |= gravity;
-            NETRootInfo(QX11Info::display(), 0).moveResizeWindowRequest(wid, flags, x, y, w, h);
+            rootInfo().moveResizeWindowRequest(wid, flags, x, y, w, h);
             FINISH;
         }
 
         if (set && command == "transientFor") {
             if (argc < 5)
-                printHelp("settransient");
-            setTransient(wid, window(QString::fromLocal8Bit(argv[4])));
+                return printHelp("settransient");
+            WId mainWindow;
+            if (!window(args.at(4), &mainWindow))
+                return 1;
+            setTransient(wid, mainWindow);
             FINISH;
         }
 
         if (command == "urgent") {
-            KWindowSystem::demandAttention(wid, set);
+            WindowSystem::demandAttention(wid, set);
             FINISH;
         }
 
@@ -405,17 +1435,20 @@ int main(int argc, char **argv)
             else if (state.toLower() == "keepbelow")
                 stateMask |= NET::KeepBelow;
             else if (state.toLower() == "minimized") {
-                if (set || (toggle && !KWindowInfo(wid, NET::WMState|NET::XAWMState).isMinimized()))
-                    KWindowSystem::minimizeWindow(wid);
+                WindowSnapshot::Client client(wid);
+                if (toggle)
+                    WindowSnapshot::read(QList<WindowSnapshot::Client*>() << &client, QList<int>() << WindowSnapshot::State);
+                if (set || (toggle && !client.minimized))
+                    WindowSystem::minimizeWindow(wid);
                 else
-                    KWindowSystem::unminimizeWindow(wid);
+                    WindowSystem::unminimizeWindow(wid);
             } else {
                 error = true;
-                std::cout << "Unknown state: " << CHAR(state) << std::endl;
+                out() << "Unknown state: " << CHAR(state) << std::endl;
             }
         }
 
-        NETWinInfo info(QX11Info::display(), wid, QX11Info::appRootWindow(), NET::WMState);
+        NETWinInfo info(display(), wid, rootWindow(), NET::WMState);
         unsigned long state = info.state();
 
         if (set)
@@ -428,197 +1461,599 @@ int main(int argc, char **argv)
         info.setState(state, stateMask);
 
         if (error)
-            printHelp("states");
+            return printHelp("states");
 
         FINISH;
     }
 
     if (command == "desktop") {
         if (argc < 3)
-            printHelp("desktop");
+            return printHelp("desktop");
 
-        command = QString::fromLocal8Bit(argv[2]);
+        command = args.at(2);
         INFO("active", currentDesktop)
         INFO("count", numberOfDesktops)
         INFO("showing", showingDesktop)
 
         if (command == "list") {
-            for (int i = 1; i <= KWindowSystem::numberOfDesktops(); ++i)
-                std::cout << CHAR(toString(i)) << ": " << CHAR(KWindowSystem::desktopName(i)) << std::endl;
+            for (int i = 1; i <= WindowSystem::numberOfDesktops(); ++i)
+                out() << CHAR(toString(i)) << ": " << CHAR(WindowSystem::desktopName(i)) << std::endl;
             FINISH;
         }
 
         if ((set = (command == "show")) || (command == "hide")) {
             const unsigned long properties[2] = {0, NET::WM2ShowingDesktop};
-            NETRootInfo(QX11Info::display(), properties, 2).setShowingDesktop(set);
+            NETRootInfo(display(), properties, 2).setShowingDesktop(set);
             FINISH;
         }
 
         if (command == "add") {
-            const int desk = (argc > 3) ? virtualDesktop(QString::fromLocal8Bit(argv[3])) : 0;
+            const int desk = (argc > 3) ? virtualDesktop(args.at(3)) : 0;
             // extend number of desktops
-            int n = KWindowSystem::numberOfDesktops() + 1;
-            const int currentDesktop = KWindowSystem::currentDesktop();
-            NETRootInfo(QX11Info::display(), NET::NumberOfDesktops).setNumberOfDesktops(n);
+            int n = WindowSystem::numberOfDesktops() + 1;
+            const int currentDesktop = WindowSystem::currentDesktop();
+            rootInfo().setNumberOfDesktops(n);
             // shift all windows on desktops above the "inserted"
             if (desk < n) { // KWS counts desktops like humans, starting by 1
-                const QList<WId> stack = KWindowSystem::stackingOrder();
-                foreach (const WId &wid, stack) {
-                    int d = KWindowInfo(wid, NET::WMDesktop).desktop();
+                const WindowSnapshot snapshot(WindowSnapshot::Desktop);
+                foreach (const WindowSnapshot::Client &client, snapshot.clients()) {
+                    int d = client.desktop;
                     if (d >= desk)
-                        KWindowSystem::setOnDesktop(wid, d+1);
+                        WindowSystem::setOnDesktop(client.id, d+1);
                 }
             }
             // rename all desktops >= the new one
-            a.processEvents(); // NOTICE the count needs to be updated on the server before!
             for (int i = n; i > desk; --i)
-                KWindowSystem::setDesktopName(i, KWindowSystem::desktopName(i-1));
-            KWindowSystem::setDesktopName(desk, argc > 4 ? QString::fromLocal8Bit(argv[4]) : QString("Desktop %1").arg(desk));
+                WindowSystem::setDesktopName(i, WindowSystem::desktopName(i-1));
+            WindowSystem::setDesktopName(desk, argc > 4 ? args.at(4) : QString("Desktop %1").arg(desk));
             if (desk <= currentDesktop)
-                KWindowSystem::setCurrentDesktop(currentDesktop + 1);
+                WindowSystem::setCurrentDesktop(currentDesktop + 1);
             FINISH;
         }
 
         if (argc < 4)
-            printHelp("desktop");
+            return printHelp("desktop");
 
         if (command == "name") {
-            const int desk = QString::fromLocal8Bit(argv[3]).toInt();
-            if (desk < 1 || desk > KWindowSystem::numberOfDesktops())
-                printHelp("falsedesk", argv[3]);
-            std::cout << CHAR(KWindowSystem::desktopName(desk)) << std::endl;
+            const int desk = args.at(3).toInt();
+            if (desk < 1 || desk > WindowSystem::numberOfDesktops())
+                return printHelp("falsedesk", args.at(3));
+            out() << CHAR(WindowSystem::desktopName(desk)) << std::endl;
             FINISH;
         }
 
         if (command == "activate") {
-            const int desk = virtualDesktop(QString::fromLocal8Bit(argv[3]));
-            if (desk < 1 || desk > KWindowSystem::numberOfDesktops())
-                printHelp("falsedesk", argv[3]);
-            KWindowSystem::setCurrentDesktop(desk);
+            const int desk = virtualDesktop(args.at(3));
+            if (desk < 1 || desk > WindowSystem::numberOfDesktops())
+                return printHelp("falsedesk", args.at(3));
+            WindowSystem::setCurrentDesktop(desk);
             FINISH;
         }
 
         if (command == "setCount") {
-            const int count = QString::fromLocal8Bit(argv[3]).toInt();
+            const int count = args.at(3).toInt();
             if (count < 1)
-                printHelp("deskcount");
-            NETRootInfo(QX11Info::display(), NET::NumberOfDesktops).setNumberOfDesktops(count);
+                return printHelp("deskcount");
+            rootInfo().setNumberOfDesktops(count);
             FINISH;
         }
 
         if (command == "remove") {
-            const int n = KWindowSystem::numberOfDesktops();
-            const QString deskId = QString::fromLocal8Bit(argv[3]);
+            const int n = WindowSystem::numberOfDesktops();
+            const QString deskId = args.at(3);
             int desk = virtualDesktop(deskId);
             if (desk < 1 || desk > n)
-                printHelp("falsedesk", deskId);
+                return printHelp("falsedesk", deskId);
 
             // shift all windows on desktops above the "removed"
             if (desk < n) {
-                const QList<WId> stack = KWindowSystem::stackingOrder();
-                foreach (const WId &wid, stack) {
-                    int d = KWindowInfo(wid, NET::WMDesktop).desktop();
+                const WindowSnapshot snapshot(WindowSnapshot::Desktop);
+                foreach (const WindowSnapshot::Client &client, snapshot.clients()) {
+                    int d = client.desktop;
                     if (d >= desk)
-                        KWindowSystem::setOnDesktop(wid, d-1);
+                        WindowSystem::setOnDesktop(client.id, d-1);
                 }
             }
             // rename all desktops >= the new one
             for (int i = desk; i < n; ++i)
-                KWindowSystem::setDesktopName(i, KWindowSystem::desktopName(i+1));
+                WindowSystem::setDesktopName(i, WindowSystem::desktopName(i+1));
 
             // finally, reduce number of desktops
-            NETRootInfo(QX11Info::display(), NET::NumberOfDesktops).setNumberOfDesktops(n-1);
-            const int cd = KWindowSystem::currentDesktop();
+            rootInfo().setNumberOfDesktops(n-1);
+            const int cd = WindowSystem::currentDesktop();
             if (desk < cd)
-                KWindowSystem::setCurrentDesktop(cd - 1);
+                WindowSystem::setCurrentDesktop(cd - 1);
             FINISH;
         }
 
         if (argc < 5)
-            printHelp("desktop");
+            return printHelp("desktop");
 
         if (command == "move") {
-            const int d1 = virtualDesktop(QString::fromLocal8Bit(argv[3]));
-            if (d1 < 1 || d1 > KWindowSystem::numberOfDesktops())
-                printHelp("falsedesk", argv[3]);
-            const int n = KWindowSystem::numberOfDesktops();
-            const int d2 = qMin(qMax(1, virtualDesktop(QString::fromLocal8Bit(argv[4]))), n);
+            const int d1 = virtualDesktop(args.at(3));
+            if (d1 < 1 || d1 > WindowSystem::numberOfDesktops())
+                return printHelp("falsedesk", args.at(3));
+            const int n = WindowSystem::numberOfDesktops();
+            const int d2 = qMin(qMax(1, virtualDesktop(args.at(4))), n);
             if (d1 == d2)
-                exit(1); // same desk
+                return 1; // same desk
 
-            QList<WId> stack = KWindowSystem::stackingOrder();
-            foreach (const WId &wid, stack) {
-                const int d = KWindowInfo(wid, NET::WMDesktop).desktop();
+            const WindowSnapshot snapshot(WindowSnapshot::Desktop);
+            foreach (const WindowSnapshot::Client &client, snapshot.clients()) {
+                const int d = client.desktop;
                 if (d == d1)
-                    KWindowSystem::setOnDesktop(wid, d2);
+                    WindowSystem::setOnDesktop(client.id, d2);
                 else if (d < d1 && d >= d2)
-                    KWindowSystem::setOnDesktop(wid, d+1);
+                    WindowSystem::setOnDesktop(client.id, d+1);
                 else if (d > d1 && d <= d2)
-                    KWindowSystem::setOnDesktop(wid, d-1);
+                    WindowSystem::setOnDesktop(client.id, d-1);
             }
 
-            const int cd = KWindowSystem::currentDesktop();
+            const int cd = WindowSystem::currentDesktop();
             if (cd == d1)
-                KWindowSystem::setCurrentDesktop(d2);
-            const QString buffer = KWindowSystem::desktopName(d1);
+                WindowSystem::setCurrentDesktop(d2);
+            const QString buffer = WindowSystem::desktopName(d1);
             if (d1 < d2) {
                 for (int i = d1; i < d2; ++i) {
-                    KWindowSystem::setDesktopName(i, KWindowSystem::desktopName(i+1));
+                    WindowSystem::setDesktopName(i, WindowSystem::desktopName(i+1));
                     if (i+1 == cd)
-                        KWindowSystem::setCurrentDesktop(i);
+                        WindowSystem::setCurrentDesktop(i);
                 }
             } else {
                 for (int i = d1; i > d2; --i) {
-                    KWindowSystem::setDesktopName(i, KWindowSystem::desktopName(i-1));
+                    WindowSystem::setDesktopName(i, WindowSystem::desktopName(i-1));
                     if (i-1 == cd)
-                        KWindowSystem::setCurrentDesktop(i);
+                        WindowSystem::setCurrentDesktop(i);
                 }
             }
-            KWindowSystem::setDesktopName(d2, buffer);
+            WindowSystem::setDesktopName(d2, buffer);
             FINISH;
         }
 
         if (command == "swap") {
-            const int d1 = virtualDesktop(QString::fromLocal8Bit(argv[3]));
-            if (d1 < 1 || d1 > KWindowSystem::numberOfDesktops())
-                printHelp("falsedesk", argv[3]);
-            const int d2 = virtualDesktop(QString::fromLocal8Bit(argv[4]));
-            if (d2 < 1 || d2 > KWindowSystem::numberOfDesktops())
-                printHelp("falsedesk", argv[4]);
+            const int d1 = virtualDesktop(args.at(3));
+            if (d1 < 1 || d1 > WindowSystem::numberOfDesktops())
+                return printHelp("falsedesk", args.at(3));
+            const int d2 = virtualDesktop(args.at(4));
+            if (d2 < 1 || d2 > WindowSystem::numberOfDesktops())
+                return printHelp("falsedesk", args.at(4));
             if (d1 == d2)
-                exit(1); // same desk
+                return 1; // same desk
 
-            const int cd = KWindowSystem::currentDesktop();
+            const int cd = WindowSystem::currentDesktop();
             if (cd == d1)
-                KWindowSystem::setCurrentDesktop(d2);
+                WindowSystem::setCurrentDesktop(d2);
             else if (cd == d2)
-                KWindowSystem::setCurrentDesktop(d1);
+                WindowSystem::setCurrentDesktop(d1);
 
-            QList<WId> stack = KWindowSystem::stackingOrder();
-            foreach (const WId &wid, stack) {
-                const int d = KWindowInfo(wid, NET::WMDesktop).desktop();
+            const WindowSnapshot snapshot(WindowSnapshot::Desktop);
+            foreach (const WindowSnapshot::Client &client, snapshot.clients()) {
+                const int d = client.desktop;
                 if (d == d1)
-                    KWindowSystem::setOnDesktop(wid, d2);
+                    WindowSystem::setOnDesktop(client.id, d2);
                 else if (d == d2)
-                    KWindowSystem::setOnDesktop(wid, d1);
+                    WindowSystem::setOnDesktop(client.id, d1);
             }
 
-            const QString buffer = KWindowSystem::desktopName(d1);
-            KWindowSystem::setDesktopName(d1, KWindowSystem::desktopName(d2));
-            KWindowSystem::setDesktopName(d2, buffer);
+            const QString buffer = WindowSystem::desktopName(d1);
+            WindowSystem::setDesktopName(d1, WindowSystem::desktopName(d2));
+            WindowSystem::setDesktopName(d2, buffer);
             FINISH;
         }
 
         if (command == "rename") {
-            const int desk = virtualDesktop(QString::fromLocal8Bit(argv[3]));
-            if (desk < 1 || desk > KWindowSystem::numberOfDesktops())
-                printHelp("falsedesk", argv[3]);
-            KWindowSystem::setDesktopName(desk, QString::fromLocal8Bit(argv[4]));
+            const int desk = virtualDesktop(args.at(3));
+            if (desk < 1 || desk > WindowSystem::numberOfDesktops())
+                return printHelp("falsedesk", args.at(3));
+            WindowSystem::setDesktopName(desk, args.at(4));
             FINISH;
         }
     }
 
-    printHelp("unknowncommand");
+    return printHelp("unknowncommand");
+}
+
+QString socketName()
+{
+    // the directory must be private, nobody else may control the windows through the server
+    QByteArray dir = qgetenv("XDG_RUNTIME_DIR");
+    if (dir.isEmpty()) {
+        dir = QFile::encodeName(QDir::tempPath()) + "/kwindowsystem-" + QByteArray::number(getuid());
+        mkdir(dir.constData(), 0700);
+        struct stat info;
+        if (lstat(dir.constData(), &info) || info.st_uid != getuid() || (info.st_mode & 077) || !S_ISDIR(info.st_mode))
+            return QString();
+    }
+    QByteArray display = qgetenv("DISPLAY");
+    display.replace('/', '_');
+    return QFile::decodeName(dir) + "/kwindowsystem" + QString::fromLocal8Bit(display);
+}
+
+bool readMessage(QLocalSocket &socket, QByteArray &message)
+{
+    while (socket.bytesAvailable() < qint64(sizeof(quint32))) {
+        if (!socket.waitForReadyRead(-1))
+            return false;
+    }
+    quint32 size;
+    QDataStream(socket.read(sizeof(quint32))) >> size;
+    while (socket.bytesAvailable() < size) {
+        if (!socket.waitForReadyRead(-1))
+            return false;
+    }
+    message = socket.read(size);
+    return true;
+}
+
+// false unless the whole message was sent
+bool writeMessage(QLocalSocket &socket, const QByteArray &message)
+{
+    QByteArray header;
+    QDataStream(&header, QIODevice::WriteOnly) << quint32(message.size());
+    if (socket.write(header + message) < 0)
+        return false;
+    while (socket.bytesToWrite()) {
+        if (!socket.waitForBytesWritten(5000))
+            return false;
+    }
+    return true;
+}
+
+class Server : public QApplication
+{
+public:
+    Server(int &argc, char **argv) : QApplication(argc, argv) {}
+protected:
+    bool x11EventFilter(XEvent *event) {
+        if (gs_cache)
+            gs_cache->event(event);
+        if (event->xany.window == rootWindow())
+            rootInfo().event(event);
+        return false;
+    }
+};
+
+class Connection;
+
+/**
+ * Runs the commands of the clients one after another. execute() processes the pending events before each
+ * command and so can get here again, those requests wait until the current one is done.
+ */
+class CommandServer : public QLocalServer
+{
+public:
+    CommandServer(Server *app) : m_app(app), m_busy(false) {}
+    void enqueue(Connection *connection, const QStringList &args);
+protected:
+    void incomingConnection(quintptr socketDescriptor);
+private:
+    QByteArray execute(const QStringList &args);
+    Server *m_app;
+    bool m_busy;
+    QList<QPair<Connection*, QStringList> > m_pending;
+};
+
+/**
+ * One client, its request is read and the reply written as the socket allows, so a client that sends
+ * nothing or reads slowly doesn't hold up the others. It gives up after 5 seconds without progress,
+ * but not while its command waits for its turn.
+ */
+class Connection : public QObject
+{
+public:
+    Connection(int fd, CommandServer *server);
+    ~Connection() { ::close(m_fd); }
+    void reply(const QByteArray &message);
+protected:
+    bool eventFilter(QObject *watched, QEvent *event);
+    void timerEvent(QTimerEvent *) { if (!m_waiting) deleteLater(); }
+private:
+    bool receive();
+    bool send();
+    int m_fd;
+    CommandServer *m_server;
+    QByteArray m_data; // the request while it comes in, then the reply
+    int m_sent;
+    bool m_waiting;
+    QSocketNotifier m_read, m_write;
+    int m_timer;
+};
+
+Connection::Connection(int fd, CommandServer *server) : m_fd(fd), m_server(server), m_sent(0), m_waiting(false),
+                                                        m_read(fd, QSocketNotifier::Read), m_write(fd, QSocketNotifier::Write)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    m_write.setEnabled(false);
+    m_read.installEventFilter(this);
+    m_write.installEventFilter(this);
+    m_timer = startTimer(5000);
+}
+
+bool Connection::eventFilter(QObject *watched, QEvent *event)
+{
+    if (event->type() != QEvent::SockAct)
+        return false;
+    const bool progress = watched == &m_read ? receive() : send();
+    if (progress) {
+        killTimer(m_timer);
+        m_timer = startTimer(5000);
+    } else {
+        m_read.setEnabled(false);
+        m_write.setEnabled(false);
+        deleteLater();
+    }
+    return true;
+}
+
+// false once the connection is done with
+bool Connection::receive()
+{
+    char buffer[4096];
+    ssize_t length;
+    while ((length = ::read(m_fd, buffer, sizeof(buffer))) > 0)
+        m_data.append(buffer, length);
+    if (!length || (errno != EAGAIN && errno != EINTR))
+        return false; // the client hung up
+    if (m_data.size() < int(sizeof(quint32)))
+        return true;
+    quint32 size;
+    QDataStream(m_data.left(sizeof(quint32))) >> size;
+    if (size > 1 << 20)
+        return false;
+    if (quint32(m_data.size()) < sizeof(quint32) + size)
+        return true;
+
+    QStringList args;
+    QDataStream(m_data.mid(sizeof(quint32), size)) >> args;
+    if (args.count() < 2)
+        return false;
+    m_read.setEnabled(false);
+    m_waiting = true;
+    m_server->enqueue(this, args);
+    return true;
+}
+
+void Connection::reply(const QByteArray &message)
+{
+    m_data.clear();
+    QDataStream(&m_data, QIODevice::WriteOnly) << quint32(message.size());
+    m_data += message;
+    m_waiting = false;
+    m_write.setEnabled(true);
+}
+
+bool Connection::send()
+{
+    while (m_sent < m_data.size()) {
+        const ssize_t length = ::send(m_fd, m_data.constData() + m_sent, m_data.size() - m_sent, MSG_NOSIGNAL);
+        if (length < 0)
+            return errno == EAGAIN || errno == EINTR;
+        m_sent += length;
+    }
+    return false; // all sent
+}
+
+void CommandServer::incomingConnection(quintptr socketDescriptor)
+{
+    new Connection(socketDescriptor, this);
+}
+
+void CommandServer::enqueue(Connection *connection, const QStringList &args)
+{
+    m_pending << qMakePair(connection, args);
+    if (m_busy)
+        return;
+    m_busy = true;
+    while (!m_pending.isEmpty()) {
+        const QPair<Connection*, QStringList> next = m_pending.takeFirst();
+        next.first->reply(execute(next.second));
+    }
+    m_busy = false;
+}
+
+QByteArray CommandServer::execute(const QStringList &args)
+{
+    // take in the events that happened before the command was sent
+    XSync(display(), False);
+    m_app->processEvents();
+
+    std::ostringstream output;
+    gs_out = &output;
+    const int status = run(args);
+    gs_out = &std::cout;
+    const std::string text = output.str();
+
+    QByteArray reply;
+    QDataStream(&reply, QIODevice::WriteOnly) << qint32(status) << QByteArray(text.data(), text.size());
+    return reply;
+}
+
+int serve(int &argc, char **argv)
+{
+    Server a(argc, argv);
+    const QString name = socketName();
+    if (name.isEmpty()) {
+        std::cout << "No private directory for the socket, set $XDG_RUNTIME_DIR" << std::endl;
+        return 1;
+    }
+    QLocalServer::removeServer(name);
+    CommandServer server(&a);
+    if (!server.listen(name)) {
+        std::cout << "Cannot listen on " << CHAR(name) << ": " << CHAR(server.errorString()) << std::endl;
+        return 1;
+    }
+    WindowCache cache;
+    gs_cache = &cache;
+    rootInfo(); // from now on it follows the root window properties
+    return a.exec();
+}
+
+// returns the exit code of the server or -1 if none is running
+int forward(const QStringList &args)
+{
+    if (!qgetenv("KWINDOWSYSTEM_NO_SERVER").isEmpty())
+        return -1;
+    const QString name = socketName();
+    if (name.isEmpty())
+        return -1;
+    QLocalSocket socket;
+    socket.connectToServer(name);
+    if (!socket.waitForConnected(100))
+        return -1;
+    QByteArray request;
+    QDataStream(&request, QIODevice::WriteOnly) << args;
+    if (!writeMessage(socket, request))
+        return -1; // the server drops incomplete requests
+    // once the server has the request it runs the command, running it here as well would eg. add two desktops
+    QByteArray reply;
+    if (!readMessage(socket, reply)) {
+        std::cerr << "The kwindowsystem server did not answer, the command may or may not have been run" << std::endl;
+        return 1;
+    }
+    qint32 status;
+    QByteArray output;
+    QDataStream(reply) >> status >> output;
+    std::cout.write(output.constData(), output.size());
+    std::cout.flush();
+    return status;
+}
+
+QStringList tokenize(const QString &line)
+{
+    QStringList tokens;
+    QString token;
+    bool inToken = false;
+    QChar quote;
+    for (int i = 0; i < line.length(); ++i) {
+        const QChar c = line.at(i);
+        if (c == '\\' && quote != '\'' && i + 1 < line.length()) {
+            token += line.at(++i);
+            inToken = true;
+        } else if (!quote.isNull()) {
+            if (c == quote)
+                quote = QChar();
+            else
+                token += c;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+            inToken = true;
+        } else if (c.isSpace()) {
+            if (inToken)
+                tokens << token;
+            token.clear();
+            inToken = false;
+        } else {
+            token += c;
+            inToken = true;
+        }
+    }
+    if (inToken)
+        tokens << token;
+    return tokens;
+}
+
+// hands the events of the requests so far to rootInfo() and the cache, like the event filter of the server does
+static void catchUp()
+{
+    XSync(display(), False);
+    while (XPending(display())) {
+        XEvent event;
+        XNextEvent(display(), &event);
+        if (gs_cache)
+            gs_cache->event(&event);
+        if (event.xany.window == rootWindow())
+            rootInfo().event(&event);
+    }
+}
+
+int runBatch(QFile &input, bool grab)
+{
+    // all commands are read before the server is grabbed, it must not wait for our input
+    QStringList lines;
+    QTextStream stream(&input);
+    while (!stream.atEnd())
+        lines << stream.readLine();
+
+    gs_batch = gs_noPick = true;
+    WindowCache cache; // one snapshot for all lookups
+    gs_cache = &cache;
+    if (grab)
+        XGrabServer(display());
+    int failures = 0;
+    for (int i = 0; i < lines.count(); ++i) {
+        const QStringList args = QStringList("kwindowsystem") + tokenize(lines.at(i));
+        if (args.count() < 2 || args.at(1).startsWith('#'))
+            continue;
+        // the window manager changes the number of desktops when it gets to it, the next line could not rely on it
+        const QString sub = args.value(2);
+        const bool desktops = args.at(1) == "desktop" && (sub == "add" || sub == "remove" || sub == "setCount");
+        if (args.at(1) == "serve" || args.at(1) == "watch" || args.at(1) == "--batch" || desktops) {
+            out() << "Line " << i + 1 << ": " << CHAR(args.mid(1, desktops ? 2 : 1).join(" "))
+                  << " cannot run in a batch" << std::endl;
+            ++failures;
+        } else if (run(args, false)) {
+            out() << "Line " << i + 1 << " failed" << std::endl;
+            ++failures;
+        }
+        catchUp();
+    }
+    if (grab)
+        XUngrabServer(display());
+    XFlush(display());
+    gs_cache = 0;
+    gs_batch = gs_noPick = false;
+    gs_resolved.clear();
+    return failures ? 1 : 0;
+}
+
+// Xlib would exit on errors, like for a window that is gone meanwhile
+static int xError(Display *, XErrorEvent *event)
+{
+    std::cerr << "X error " << int(event->error_code) << " on request " << int(event->request_code) << std::endl;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+        return printHelp();
+
+    QStringList args;
+    for (int i = 0; i < argc; ++i)
+        args << QString::fromLocal8Bit(argv[i]);
+    if (args.at(1) == "serve")
+        return serve(argc, argv);
+    // picking grabs the mouse, that has to happen in this process. watch streams, a batch has its own connection
+    if (!(args.at(1) == "id" && args.value(2) != "active") && !args.contains("pick") && args.at(1) != "watch" && args.at(1) != "--batch") {
+        const int ret = forward(args);
+        if (ret > -1)
+            return ret;
+    }
+
+    gs_argc = argc;
+    gs_argv = argv;
+    if (!display()) {
+        std::cout << "Cannot connect to the X server" << std::endl;
+        return 1;
+    }
+    XSetErrorHandler(xError);
+
+    if (args.at(1) == "--batch") {
+        const bool grab = args.value(2) == "--grab";
+        QFile input;
+        if (args.count() > 2 + grab) {
+            input.setFileName(args.at(2 + grab));
+            if (!input.open(QIODevice::ReadOnly | QIODevice::Text)) {
+                std::cout << "Cannot read " << CHAR(args.at(2 + grab)) << std::endl;
+                return 1;
+            }
+        } else {
+            input.open(stdin, QIODevice::ReadOnly | QIODevice::Text);
+        }
+        return runBatch(input, grab);
+    }
+    return run(args);
+}
 
 
 // UNIMPLEMENTED -----------------------------------------------------
@@ -648,6 +2083,3 @@ int main(int argc, char **argv)
 // void    restackRequest (Window window, RequestSource source, Window above, int detail, Time timestamp)
 // int     screenNumber() const
 // void    sendPing(Window window, Time timestamp)
-
-
-}
\ No newline at end of file
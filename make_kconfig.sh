@@ -1,11 +1,16 @@
 #!/bin/sh
+for lib in $(ldd `which kde4-config` | sed '/\(libkdecore\.so\|libQtCore\.so\)/!d; s/^.* => \([^ ]*\) .*/\1/g'); do
+    LIB_PATH="${LIB_PATH} -L`dirname $lib`"
+done
+FLAGS="`pkg-config --libs --cflags QtCore QtNetwork` -I`kde4-config --path include | sed 's%:%KDE -I%g; s%$%KDE%g'` $LIB_PATH -lkdecore"
 if ( [ ! -e kconfig ] || [ kconfig.cpp -nt kconfig ] ); then
-    for lib in $(ldd `which kde4-config` | sed '/\(libkdecore\.so\|libQtCore\.so\)/!d; s/^.* => \([^ ]*\) .*/\1/g'); do
-        LIB_PATH="${LIB_PATH} -L`dirname $lib`"
-    done
-    g++ `pkg-config --libs --cflags QtCore` \
-        -I`kde4-config --path include | sed 's%:%KDE -I%g; s%$%KDE%g'` $LIB_PATH  -lkdecore -o kconfig kconfig.cpp
+    g++ $FLAGS -o kconfig kconfig.cpp
+fi
+# the engine without main(), for the zsh module (zsh/module)
+if ( [ "$1" = "lib" ] || [ "$2" = "lib" ] ) && ( [ ! -e libkconfigcore.so ] || [ kconfig.cpp -nt libkconfigcore.so ] ); then
+    g++ -DKCONFIG_LIBRARY -fPIC -shared $FLAGS -o libkconfigcore.so kconfig.cpp
 fi
 if [ "$1" = "install" ]; then
     install -v kconfig "`kde4-config --prefix`/bin/"
+    [ -e libkconfigcore.so ] && install -v libkconfigcore.so "`kde4-config --install lib`"
 fi
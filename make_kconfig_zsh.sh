@@ -0,0 +1,19 @@
+#!/bin/sh
+# builds the zsh module (zsh/module) inside a zsh source tree, zsh modules need its headers and build system
+if [ ! -e "$1/Src/Modules" ]; then
+    echo "usage: $0 <zsh source dir> [install]"
+    exit 1
+fi
+./make_kconfig.sh lib || exit 1
+cp -v zsh/module/kconfig.c zsh/module/kconfig.mdd "$1/Src/Modules/"
+cd "$1"
+# configure collects the modules from the .mdd files
+if [ -e config.status ]; then
+    ./config.status --recheck && ./config.status
+else
+    ./configure
+fi
+make || exit 1
+if [ "$2" = "install" ]; then
+    make install.modules
+fi
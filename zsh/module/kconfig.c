@@ -0,0 +1,124 @@
+/*
+ * kconfig.c - the kconfig engine inside zsh, for completion without starting a process
+ *
+ * zmodload kconfig
+ * zkconfig <component> <command> [<key>] [<value>] [<new value>]
+ * zkconfig --components [<filter>]
+ *     runs like "kconfig ..." and puts the output lines into $reply.
+ *     parsed configs stay in memory until their files change.
+ *
+ * The engine is libkconfigcore.so (./make_kconfig.sh lib), it's opened on load so zsh does not
+ * have to be linked against Qt and KDE. $KCONFIG_CORE overrides where it is searched.
+ */
+
+#include "kconfig.mdh"
+#include "kconfig.pro"
+
+#include <dlfcn.h>
+
+typedef int (*query_func)(int argc, const char *const *argv, char **output, int *length);
+
+static void *library;
+static query_func query;
+
+/**/
+static int
+bin_zkconfig(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
+{
+    char *plain[5], *output, *line, *end, **lines;
+    int argc, length, count, ret;
+
+    if (!query) {
+        zwarnnam(nam, "libkconfigcore.so is not loaded");
+        return 2;
+    }
+    for (argc = 0; args[argc] && argc < 5; ++argc)
+        plain[argc] = unmetafy(dupstring(args[argc]), NULL);
+
+    ret = query(argc, (const char *const *)plain, &output, &length);
+    if (!output) {
+        setaparam("reply", zshcalloc(sizeof(char *)));
+        return 2;
+    }
+
+    for (count = 0, line = output; line < output + length; ++line)
+        if (*line == '\n')
+            ++count;
+    lines = (char **)zalloc((count + 2) * sizeof(char *));
+    for (count = 0, line = output; line < output + length; line = end + 1) {
+        if (!(end = memchr(line, '\n', output + length - line)))
+            end = output + length;
+        *end = '\0';
+        lines[count++] = ztrdup_metafy(line);
+    }
+    lines[count] = NULL;
+    free(output);
+    setaparam("reply", lines);
+    return ret;
+}
+
+static struct builtin bintab[] = {
+    BUILTIN("zkconfig", 0, bin_zkconfig, 1, 5, 0, NULL, NULL),
+};
+
+static struct features module_features = {
+    bintab, sizeof(bintab)/sizeof(*bintab),
+    NULL, 0,
+    NULL, 0,
+    NULL, 0,
+    0
+};
+
+/**/
+int
+setup_(UNUSED(Module m))
+{
+    return 0;
+}
+
+/**/
+int
+features_(Module m, char ***features)
+{
+    *features = featuresarray(m, &module_features);
+    return 0;
+}
+
+/**/
+int
+enables_(Module m, int **enables)
+{
+    return handlefeatures(m, &module_features, enables);
+}
+
+/**/
+int
+boot_(UNUSED(Module m))
+{
+    char *path = getenv("KCONFIG_CORE");
+
+    if (!library)
+        library = dlopen(path && *path ? path : "libkconfigcore.so", RTLD_NOW | RTLD_GLOBAL);
+    if (!library) {
+        zwarn("kconfig: %s", dlerror());
+        return 1;
+    }
+    query = (query_func)dlsym(library, "kconfig_query");
+    return !query;
+}
+
+/**/
+int
+cleanup_(Module m)
+{
+    return setfeatureenables(m, &module_features, NULL);
+}
+
+/**/
+int
+finish_(UNUSED(Module m))
+{
+    /* Qt does not survive being unloaded, the library stays until the shell exits */
+    query = NULL;
+    return 0;
+}